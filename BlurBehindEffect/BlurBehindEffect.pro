@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-CONFIG += c++1z
+CONFIG += c++1z simd
 QT       += core gui opengl
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
@@ -30,17 +30,30 @@ SOURCES += \
     widget.cpp \
     wigglywidget.cpp \
     boxblur.cpp \
+    downsample.cpp \
+    kawaseblur.cpp \
     stackblur.cpp \
+    blurplan.cpp \
     glblurfunctions.cpp \
+    glblurservice.cpp \
     blurbehindeffect.cpp
 
 HEADERS += \
     widget.h \
     wigglywidget.h \
     blur.h \
+    blurparallel_p.h \
+    stackblur_p.h \
+    stackblur_simd_p.h \
     glblurfunctions.h \
+    glblurservice_p.h \
     vertex.h \
     blurbehindeffect.h
 
+# SIMD stackblur kernels, selected at runtime
+SSE2_SOURCES += stackblur_sse2.cpp
+SSE4_1_SOURCES += stackblur_sse4.cpp
+AVX2_SOURCES += stackblur_avx2.cpp
+
 RESOURCES += \
     resources.qrc
@@ -1,9 +1,151 @@
 #pragma once
+#include <memory>
 #include <QImage>
+#include <QColor>
+#include <QRegion>
+
+/// Non-owning view of pixels in caller owned memory (frame buffers,
+/// XImage/SHM segments, QImage scanlines), the blur functions taking
+/// it work in place and never allocate, convert or detach the pixels.
+struct BlurImageRef
+{
+    uchar* bits = nullptr;
+    int width = 0;
+    int height = 0;
+    int bytesPerLine = 0;
+    QImage::Format format = QImage::Format_Invalid;
+
+    BlurImageRef() = default;
+
+    BlurImageRef(uchar* _bits, int _width, int _height, int _bytesPerLine, QImage::Format _format)
+        : bits(_bits), width(_width), height(_height), bytesPerLine(_bytesPerLine), format(_format)
+    {
+    }
+
+    /// Refers to pixels of _image, which is detached here only if it is shared
+    explicit BlurImageRef(QImage& _image)
+        : BlurImageRef(_image.bits(), _image.width(), _image.height(), _image.bytesPerLine(), _image.format())
+    {
+    }
+
+    /// Read only view of _image pixels, unlike BlurImageRef(QImage&) it never
+    /// detaches, so it is only valid as a source, which is never written
+    static BlurImageRef constView(const QImage& _image)
+    {
+        return BlurImageRef(const_cast<uchar*>(_image.constBits()), _image.width(), _image.height(), _image.bytesPerLine(), _image.format());
+    }
+
+    bool isNull() const { return !bits || width <= 0 || height <= 0; }
+    int depth() const { return QImage::toPixelFormat(format).bitsPerPixel(); }
+    bool isSingleChannel() const { return format == QImage::Format_Alpha8 || format == QImage::Format_Grayscale8; }
+    QRect rect() const { return QRect(0, 0, width, height); }
+    uchar* scanLine(int _y) const { return bits + std::ptrdiff_t(_y) * bytesPerLine; }
+
+    /// View of the _rect part of this buffer sharing the same memory, _rect is clipped to the buffer
+    BlurImageRef subRect(const QRect& _rect) const
+    {
+        const QRect r = _rect & rect();
+        if (r.isEmpty())
+            return BlurImageRef{};
+        return BlurImageRef(scanLine(r.y()) + r.x() * (depth() / 8), r.width(), r.height(), bytesPerLine, format);
+    }
+};
+
+
+//
+// In place blurring of caller owned 32-bit buffers, functions return
+// false (leaving pixels untouched) if the buffer format is not supported.
+// Box, sliding box and stack blurs also take single channel Alpha8 and
+// Grayscale8 buffers, which is 4x less work for masks and shadows.
+//
+
+bool boxBlur(const BlurImageRef& _image, int _radius);
+bool slidingBoxBlur(const BlurImageRef& _image, int _radius, int _passes = 3, int _threadCount = 1);
+bool stackBlur(const BlurImageRef& _image, int _radius, int _threadCount = 1);
+bool kawaseBlur(const BlurImageRef& _image, int _offset, int _iterations, int _threadCount = 1);
+
+
+/// Area averaging (box filter) resampling of 32-bit premultiplied or opaque
+/// _source into preallocated _target of any size. Sub rect views let it read
+/// grabbed pixels in place, so cropping, scaling and conversion to the blur
+/// input format are a single pass over the pixels.
+bool downsample(const BlurImageRef& _source, const BlurImageRef& _target, int _threadCount = 1);
+
+
+//
+// Convenience wrappers returning blurred copy of the image
+//
 
 QImage boxBlurImage(const QImage& _image, const QRect& _rect, int _radius);
 inline QImage boxBlurImage(const QImage& _image, int _radius) { return boxBlurImage(_image, _image.rect(), _radius); }
 
+/// Gaussian approximation by _passes sliding box blurs, cost does not depend on the radius
+QImage slidingBoxBlurImage(const QImage& _image, int _radius, int _passes = 3, int _threadCount = 1);
+
 QImage stackBlurImage(const QImage& _image, int _radius, int _threadCount = 1);
 
+/// Soft shadow of the _shape alpha filled with _color, only the alpha channel
+/// is blurred. Result is premultiplied and _radius larger on every side, so
+/// _shape is drawn at (_radius, _radius) of it.
+QImage shadowImage(const QImage& _shape, int _radius, const QColor& _color, int _threadCount = 1);
+
+/// CPU version of GLBlurFunctions::blurImage_DualKawase(), radius grows
+/// exponentially with _iterations, while the cost is dominated by the full size level
+QImage kawaseBlurImage(const QImage& _image, int _offset, int _iterations, int _threadCount = 1);
+
+
+/// Reusable stackblur executor, similar to FFTW plan.
+///
+/// Plan is created once per (size, radius, thread count) and keeps its
+/// worker threads and per-worker stacks alive between the calls, passes
+/// are synchronized with a lightweight barrier instead of thread pool
+/// start/join. Thread count is derived from the image size, so tiny
+/// images are blurred in the calling thread.
+class BlurPlan
+{
+    Q_DISABLE_COPY(BlurPlan)
+
+public:
+    enum class Mode
+    {
+        Auto,   ///< tiled for large images on many cores and moderate radii, banded otherwise
+        Banded, ///< row bands for the first pass, column bands for the second one
+        Tiled   ///< independent tiles with radius wide halo, balanced by work stealing
+    };
+
+    BlurPlan(const QSize& _size, int _radius, int _maxThreadCount = 1, Mode _mode = Mode::Auto);
+    ~BlurPlan();
+
+    QSize size() const;
+    int radius() const;
+    int maxThreadCount() const;
+    int threadCount() const;
+    Mode mode() const;
+
+    bool matches(const QSize& _size, int _radius, int _maxThreadCount) const;
+    bool isExecutable(const QImage& _image) const;
+    bool isExecutable(const BlurImageRef& _image) const;
+
+    /// Blurs 32-bit image of the plan size in place
+    void execute(QImage& _image);
+    void execute(const BlurImageRef& _image);
+
+    /// Blurs _source into _target, which is (re)allocated if it does not match the source
+    void execute(const QImage& _source, QImage& _target);
+
+    /// Blurs _source into preallocated _target of the plan size, _source is only read
+    void execute(const BlurImageRef& _source, const BlurImageRef& _target);
+
+    /// Incremental update of _target, which holds the blur of the previous
+    /// _source, after the pixels in _dirty of _source changed. Only the rects
+    /// of _dirty grown by the radius are blurred again, so the cost follows
+    /// the size of the changes, not of their bounding rect. Changes covering
+    /// a large part of the image fall back to the full execution.
+    void execute(const BlurImageRef& _source, const BlurImageRef& _target, const QRegion& _dirty);
+
+    /// Thread count worth using for an image of _size, -1 means any
+    static int suitableThreadCount(const QSize& _size, int _maxThreadCount);
 
+private:
+    std::unique_ptr<class BlurPlanPrivate> d;
+};
@@ -1,73 +1,1251 @@
 #include "blurbehindeffect.h"
-#include "glblurfunctions.h"
+#include "glblurservice_p.h"
 #include "blur.h"
 
 #include <QPainter>
+#include <QPaintEngine>
 #include <QWidget>
 #include <QThread>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QTimer>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <vector>
+
+namespace
+{
+    /// Parameters of a single blur, jobs of the asynchronous mode carry
+    /// their own copy, so the setters never race with a running blur
+    struct BlurSettings
+    {
+        BlurBehindEffect::BlurMethod method;
+        int radius;
+        int threadCount;
+    };
+
+    /// Dual Kawase passes stop here, the level of the last one is 1/1024 of
+    /// the source size, further ones have no pixels left to blur
+    constexpr int maxKawaseIterations() noexcept { return 10; }
+
+    /// Dual Kawase passes of _radius for the CPU and GL blur and their support
+    int kawaseIterations(int _radius)
+    {
+        return std::clamp(_radius - 2, 1, maxKawaseIterations());
+    }
+
+    /// Copies _source into _target converting it to _format, buffer of
+    /// _target is reused when it already has the right size and format
+    void copyPixels(const QImage& _source, QImage& _target, QImage::Format _format)
+    {
+        if (_source.format() != _format)
+        {
+            _target = _source.convertToFormat(_format);
+            return;
+        }
+
+        if (_target.size() != _source.size() || _target.format() != _format)
+            _target = QImage(_source.size(), _format);
+
+        const int bytes = _source.width() * _source.depth() / 8;
+        for (int y = 0; y < _source.height(); ++y)
+            std::memcpy(_target.scanLine(y), _source.constScanLine(y), bytes);
+    }
+
+    /// Blurs _input into _output with one of the CPU methods, _output is reused
+    /// between frames to avoid reallocations. Stackblur plan is (re)created in _plan
+    void blurImageCpu(const BlurSettings& _settings, std::unique_ptr<BlurPlan>& _plan, const QImage& _input, QImage& _output)
+    {
+        switch(_settings.method)
+        {
+        case BlurBehindEffect::BlurMethod::BoxBlur:
+            copyPixels(_input, _output, QImage::Format_ARGB32_Premultiplied);
+            boxBlur(BlurImageRef(_output), _settings.radius);
+            break;
+        case BlurBehindEffect::BlurMethod::StackBlur:
+            if (!_plan || !_plan->matches(_input.size(), _settings.radius, _settings.threadCount))
+                _plan = std::make_unique<BlurPlan>(_input.size(), _settings.radius, _settings.threadCount);
+
+            if (_plan->isExecutable(_input))
+                _plan->execute(_input, _output);
+            else
+                _output = _input;
+            break;
+        case BlurBehindEffect::BlurMethod::GLBlur:
+            Q_ASSERT(!"GL blur must run in the GUI thread");
+            _output = _input;
+            break;
+        case BlurBehindEffect::BlurMethod::SlidingBoxBlur:
+            copyPixels(_input, _output, QImage::Format_ARGB32_Premultiplied);
+            slidingBoxBlur(BlurImageRef(_output), _settings.radius, 3, _settings.threadCount);
+            break;
+        case BlurBehindEffect::BlurMethod::DualKawaseBlur:
+            copyPixels(_input, _output, QImage::Format_ARGB32_Premultiplied);
+            kawaseBlur(BlurImageRef(_output), 2, kawaseIterations(_settings.radius), _settings.threadCount);
+            break;
+        }
+        _output.setDevicePixelRatio(_input.devicePixelRatioF());
+    }
+
+    /// Changed pixels further apart than this stay in separate rects
+    constexpr int changeGap() noexcept { return 16; }
+
+    /// Above this many rects a dirty region is reduced to its bounding rect
+    constexpr int maxDirtyRects() noexcept { return 16; }
+
+    /// Pixels differing between 32-bit images of the same size and format,
+    /// rows are compared with memcmp before looking for pixels. Changes closer
+    /// than changeGap() are joined into the bounding rect of each group, so
+    /// distant changes like a blinking cursor and a spinner stay apart.
+    QRegion changedRegion(const QImage& _a, const QImage& _b)
+    {
+        std::vector<QRect> rects;
+        for (int y = 0; y < _a.height(); ++y)
+        {
+            const quint32* a = reinterpret_cast<const quint32*>(_a.constScanLine(y));
+            const quint32* b = reinterpret_cast<const quint32*>(_b.constScanLine(y));
+            if (std::memcmp(a, b, _a.width() * 4) == 0)
+                continue;
+
+            for (int x = 0; x < _a.width();)
+            {
+                while (x < _a.width() && a[x] == b[x])
+                    ++x;
+                if (x == _a.width())
+                    break;
+
+                // a span ends after changeGap() equal pixels
+                const int x0 = x;
+                int x1 = x;
+                for (; x < _a.width() && x - x1 <= changeGap(); ++x)
+                {
+                    if (a[x] != b[x])
+                        x1 = x;
+                }
+
+                QRect span(x0, y, x1 - x0 + 1, 1);
+                for (std::size_t i = 0; i < rects.size();)
+                {
+                    if (rects[i].adjusted(-changeGap(), -changeGap(), changeGap(), changeGap()).intersects(span))
+                    {
+                        span |= rects[i];
+                        rects.erase(rects.begin() + i);
+                        i = 0;
+                    }
+                    else
+                    {
+                        ++i;
+                    }
+                }
+                rects.push_back(span);
+
+                // scattered changes, e.g. noise, end up in one rect
+                if (int(rects.size()) > maxDirtyRects())
+                {
+                    QRect bounding;
+                    for (const QRect& rect : rects)
+                        bounding |= rect;
+                    rects.assign(1, bounding);
+                }
+            }
+        }
+
+        QRegion region;
+        for (const QRect& rect : rects)
+            region |= rect;
+        return region;
+    }
+
+    /// Distance in pixels the blur of _settings spreads a pixel to, the
+    /// recursive and the pyramid based methods are cut where they fade out
+    int blurSupport(const BlurSettings& _settings)
+    {
+        switch(_settings.method)
+        {
+        case BlurBehindEffect::BlurMethod::StackBlur:
+            return _settings.radius;
+        case BlurBehindEffect::BlurMethod::BoxBlur:
+        case BlurBehindEffect::BlurMethod::SlidingBoxBlur:
+            return 3 * _settings.radius;
+        case BlurBehindEffect::BlurMethod::GLBlur:
+        case BlurBehindEffect::BlurMethod::DualKawaseBlur:
+            return 4 << kawaseIterations(_settings.radius);
+        }
+        return _settings.radius;
+    }
+
+    /// Stages of a frame timed for BlurBehindEffect::statistics()
+    enum class Stage
+    {
+        Grab,
+        Downsample,
+        ChangeDetect,
+        Blur,
+        Upscale,
+        Composite,
+        Count
+    };
+
+    /// Durations of the last frames in nanoseconds kept in a ring
+    class RollingSamples
+    {
+    public:
+        void add(qint64 _nsecs)
+        {
+            samples_[next_] = _nsecs;
+            next_ = (next_ + 1) % samples_.size();
+            count_ = std::min(count_ + 1, samples_.size());
+        }
+
+        BlurBehindEffect::StageTimings timings() const
+        {
+            BlurBehindEffect::StageTimings result;
+            if (count_ == 0)
+                return result;
+
+            std::array<qint64, 128> sorted;
+            std::copy_n(samples_.begin(), count_, sorted.begin());
+            std::sort(sorted.begin(), sorted.begin() + count_);
+
+            // nearest rank
+            const auto percentile = [&](int _p) { return sorted[(std::size_t(_p) * count_ + 99) / 100 - 1] / 1e6; };
+            result.last = samples_[(next_ + samples_.size() - 1) % samples_.size()] / 1e6;
+            result.median = percentile(50);
+            result.p90 = percentile(90);
+            result.p99 = percentile(99);
+            result.samples = int(count_);
+            return result;
+        }
+
+    private:
+        std::array<qint64, 128> samples_{};
+        std::size_t next_ = 0;
+        std::size_t count_ = 0;
+    };
+
+    /// Rect of the blurred region and the place of its copy in the atlas
+    struct AtlasSlot
+    {
+        QRect rect;        ///< in pixels of the downsampled region bounds
+        QPoint position;   ///< top left of the copy, the halo lies around it
+
+        bool operator==(const AtlasSlot& _other) const { return rect == _other.rect && position == _other.position; }
+    };
+
+    /// Disjoint rects of the region packed into a single image, so they are
+    /// blurred in one pass without blurring the gaps between them. Every
+    /// rect is surrounded by a halo of its edge pixels as wide as the blur
+    /// support, which keeps the rects from bleeding into each other.
+    /// An empty layout means the region bounds are blurred as they are.
+    struct AtlasLayout
+    {
+        QSize regionSize;
+        QSize size;
+        int halo = 0;
+        std::vector<AtlasSlot> slots;
+
+        bool isEmpty() const { return slots.empty(); }
+
+        bool operator==(const AtlasLayout& _other) const
+        {
+            return regionSize == _other.regionSize && size == _other.size && halo == _other.halo && slots == _other.slots;
+        }
+    };
+
+    /// Packs rects of _region in _bounds downsampled to _size into shelves, returns
+    /// an empty layout when the atlas would not be much smaller than the bounds
+    AtlasLayout packAtlas(const QRegion& _region, const QRect& _bounds, const QSize& _size, int _halo)
+    {
+        const QRect area(QPoint(), _size);
+        const qreal sx = qreal(_size.width()) / _bounds.width();
+        const qreal sy = qreal(_size.height()) / _bounds.height();
+        std::vector<QRect> rects;
+        for (const QRect& r : _region)
+        {
+            const QRectF scaled((r.x() - _bounds.x()) * sx, (r.y() - _bounds.y()) * sy, r.width() * sx, r.height() * sy);
+            const QRect rect = scaled.toAlignedRect() & area;
+            if (!rect.isEmpty())
+                rects.push_back(rect);
+        }
+
+        // rects whose halos touch are merged, this also joins the scanline
+        // bands QRegion splits rounded shapes into
+        const int gap = 2 * _halo;
+        for (bool merged = true; merged; )
+        {
+            merged = false;
+            for (std::size_t i = 0; i < rects.size(); ++i)
+            {
+                for (std::size_t j = i + 1; j < rects.size(); )
+                {
+                    if (!rects[i].adjusted(-gap, -gap, gap, gap).intersects(rects[j]))
+                    {
+                        ++j;
+                        continue;
+                    }
+                    rects[i] |= rects[j];
+                    rects.erase(rects.begin() + std::ptrdiff_t(j));
+                    merged = true;
+                }
+            }
+        }
+        if (rects.size() < 2)
+            return {};
+
+        // tallest rects first, shelves are as wide as a square of the same area
+        std::sort(rects.begin(), rects.end(), [](const QRect& _a, const QRect& _b) { return _a.height() > _b.height(); });
+        qint64 padded = 0;
+        int width = 0;
+        for (const QRect& r : rects)
+        {
+            padded += qint64(r.width() + gap) * (r.height() + gap);
+            width = std::max(width, r.width() + gap);
+        }
+        width = std::max(width, int(std::ceil(std::sqrt(double(padded)))));
+
+        AtlasLayout layout;
+        layout.regionSize = _size;
+        layout.halo = _halo;
+        int x = 0;
+        int y = 0;
+        int shelf = 0;
+        for (const QRect& r : rects)
+        {
+            if (x + r.width() + gap > width)
+            {
+                x = 0;
+                y += shelf;
+                shelf = 0;
+            }
+            layout.slots.push_back({ r, QPoint(x + _halo, y + _halo) });
+            x += r.width() + gap;
+            shelf = std::max(shelf, r.height() + gap);
+        }
+        layout.size = QSize(width, y + shelf);
+
+        if (qint64(layout.size.width()) * layout.size.height() * 4 > qint64(_size.width()) * _size.height() * 3)
+            return {};
+        return layout;
+    }
+
+    /// Fills _halo pixels around _rect of a 32-bit _image with copies of its
+    /// edge pixels, so a blur of the whole image clamps at the edges of _rect
+    void extendEdges(QImage& _image, const QRect& _rect, int _halo)
+    {
+        const QRect outer = _rect.adjusted(-_halo, -_halo, _halo, _halo) & _image.rect();
+        for (int y = _rect.top(); y <= _rect.bottom(); ++y)
+        {
+            quint32* line = reinterpret_cast<quint32*>(_image.scanLine(y));
+            std::fill(line + outer.left(), line + _rect.left(), line[_rect.left()]);
+            std::fill(line + _rect.right() + 1, line + outer.right() + 1, line[_rect.right()]);
+        }
+
+        const int offset = outer.left() * 4;
+        const int bytes = outer.width() * 4;
+        for (int y = outer.top(); y < _rect.top(); ++y)
+            std::memcpy(_image.scanLine(y) + offset, _image.constScanLine(_rect.top()) + offset, bytes);
+        for (int y = _rect.bottom() + 1; y <= outer.bottom(); ++y)
+            std::memcpy(_image.scanLine(y) + offset, _image.constScanLine(_rect.bottom()) + offset, bytes);
+    }
+
+    /// Stack blurs of a single source for radii that change between frames.
+    ///
+    /// Level k blurs the source halved k times with baseRadius() and is scaled
+    /// back to the source size. Levels shrink by four, so the whole pyramid
+    /// costs about a third more than one blur. A radius between two levels is
+    /// blended from both with the weight that matches the variance of its
+    /// kernel, halving and scaling add a box and a tent filter to every level.
+    /// Levels are built on first use and kept until reset().
+    class BlurPyramid
+    {
+    public:
+        static constexpr int baseRadius() { return 2; }
+
+        void reset()
+        {
+            levels_.clear();
+        }
+
+        /// Writes the approximate blur of _source at _radius to _output, _source
+        /// must be the same image for all calls since the last reset()
+        void blur(const QImage& _source, int _radius, int _threadCount, QImage& _output)
+        {
+            const double variance = stackVariance(std::max(_radius, baseRadius()));
+            int lower = 0;
+            while (levelVariance(lower + 1) <= variance)
+                ++lower;
+            const double t = (variance - levelVariance(lower)) / (levelVariance(lower + 1) - levelVariance(lower));
+            const int weight = int(std::lround(t * 256));
+
+            const QImage* a = level(_source, lower, _threadCount);
+            const QImage* b = weight > 0 ? level(_source, lower + 1, _threadCount) : nullptr;
+            if (!a)
+                a = &levels_.back().scaled;
+
+            if (_output.size() != _source.size() || _output.format() != _source.format())
+                _output = QImage(_source.size(), _source.format());
+
+            const int bytes = _source.width() * 4;
+            for (int y = 0; y < _source.height(); ++y)
+            {
+                const uchar* pa = a->constScanLine(y);
+                uchar* dst = _output.scanLine(y);
+                if (!b)
+                {
+                    std::memcpy(dst, pa, bytes);
+                    continue;
+                }
+
+                // both terms stay unsigned, so the rounding is the same for
+                // either sign of the difference and no negative value is shifted
+                const uchar* pb = b->constScanLine(y);
+                const unsigned int wb = unsigned(weight);
+                const unsigned int wa = 256 - wb;
+                for (int i = 0; i < bytes; ++i)
+                    dst[i] = uchar((pa[i] * wa + pb[i] * wb + 128) >> 8);
+            }
+            _output.setDevicePixelRatio(_source.devicePixelRatioF());
+        }
+
+    private:
+        /// Variance of the stackblur kernel of _radius in pixels squared
+        static double stackVariance(int _radius)
+        {
+            return _radius * (_radius + 2) / 6.0;
+        }
+
+        static double levelVariance(int _k)
+        {
+            if (_k == 0)
+                return stackVariance(baseRadius());
+
+            // box of the halving and tent of the bilinear upscale
+            const double scale = std::pow(4.0, _k);
+            return scale * (stackVariance(baseRadius()) + 1.0 / 12.0 + 1.0 / 6.0);
+        }
+
+        struct Level
+        {
+            QImage source; ///< halved source, null for the first level
+            QImage scaled; ///< blurred and scaled back to the source size
+        };
+
+        /// Level _k, nullptr if the source is too small to be halved that often
+        const QImage* level(const QImage& _source, int _k, int _threadCount)
+        {
+            while (int(levels_.size()) <= _k)
+            {
+                const QImage& previous = levels_.size() <= 1 ? _source : levels_.back().source;
+                Level level;
+                QImage blurred;
+                if (levels_.empty())
+                {
+                    blurred = _source.copy();
+                }
+                else
+                {
+                    const QSize size(previous.width() / 2, previous.height() / 2);
+                    if (size.width() < 2 * baseRadius() || size.height() < 2 * baseRadius())
+                        return nullptr;
+
+                    level.source = QImage(size, _source.format());
+                    downsample(BlurImageRef::constView(previous), BlurImageRef(level.source), _threadCount);
+                    blurred = level.source.copy();
+                }
+
+                stackBlur(BlurImageRef(blurred), baseRadius(), _threadCount);
+                level.scaled = levels_.empty() ? blurred : blurred.scaled(_source.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+                levels_.push_back(std::move(level));
+            }
+            return &levels_[std::size_t(_k)].scaled;
+        }
+
+        std::vector<Level> levels_;
+    };
+
+    /// Superseding job queue of the asynchronous mode.
+    ///
+    /// A single worker thread blurs one frame at a time. A frame submitted
+    /// while another one waits replaces it, so stale frames are dropped
+    /// without being blurred. The running frame is still delivered, since
+    /// under continuous changes cancelling it would starve the display;
+    /// cancel() discards it when its settings no longer apply.
+    class AsyncBlurQueue
+    {
+    public:
+        /// _finished is called in the worker thread after every delivered blur
+        explicit AsyncBlurQueue(std::function<void()> _finished)
+            : finished_(std::move(_finished))
+        {
+        }
+
+        ~AsyncBlurQueue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                quit_ = true;
+            }
+            wakeUp_.notify_one();
+            if (worker_.joinable())
+                worker_.join();
+        }
+
+        void submit(const QImage& _source, const BlurSettings& _settings)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_ = _source;
+                pendingSettings_ = _settings;
+                hasPending_ = true;
+                if (!worker_.joinable())
+                    worker_ = std::thread([this] { run(); });
+            }
+            wakeUp_.notify_one();
+        }
+
+        /// Drops the waiting frame and the result of the running one
+        void cancel()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ = QImage();
+            hasPending_ = false;
+            hasResult_ = false;
+            ++epoch_;
+        }
+
+        /// Swaps the latest finished blur into _image, the previous
+        /// contents of _image are recycled as the next output buffer.
+        /// _nsecs receives the time the blur took in the worker
+        bool takeResult(QImage& _image, qint64& _nsecs)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!hasResult_)
+                return false;
+
+            _nsecs = resultNsecs_;
+            _image.swap(result_);
+            spare_ = std::move(result_);
+            result_ = QImage();
+            hasResult_ = false;
+            return true;
+        }
+
+    private:
+        void run()
+        {
+            std::unique_ptr<BlurPlan> plan;
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;)
+            {
+                wakeUp_.wait(lock, [this] { return quit_ || hasPending_; });
+                if (quit_)
+                    return;
+
+                const QImage source = std::move(pending_);
+                const BlurSettings settings = pendingSettings_;
+                const quint64 epoch = epoch_;
+                QImage output = std::move(spare_);
+                pending_ = QImage();
+                spare_ = QImage();
+                hasPending_ = false;
+
+                lock.unlock();
+                QElapsedTimer timer;
+                timer.start();
+                blurImageCpu(settings, plan, source, output);
+                const qint64 nsecs = timer.nsecsElapsed();
+                lock.lock();
+
+                if (epoch != epoch_)
+                {
+                    spare_ = std::move(output);
+                    continue;
+                }
+
+                // an unclaimed older result is replaced
+                result_ = std::move(output);
+                resultNsecs_ = nsecs;
+                hasResult_ = true;
+
+                lock.unlock();
+                finished_();
+                lock.lock();
+            }
+        }
+
+        std::function<void()> finished_;
+        std::thread worker_;
+        std::mutex mutex_;
+        std::condition_variable wakeUp_;
+        QImage pending_;
+        BlurSettings pendingSettings_{};
+        QImage result_;
+        QImage spare_;
+        quint64 epoch_ = 0;
+        qint64 resultNsecs_ = 0;
+        bool hasPending_ = false;
+        bool hasResult_ = false;
+        bool quit_ = false;
+    };
+}
 
 class BlurBehindEffectPrivate
 {
 public:
-    GLBlurFunctions glBlur_;
+    std::shared_ptr<GLBlurService> glBlur_; ///< held while GLBlur is selected
+    std::unique_ptr<BlurPlan> stackBlurPlan_;
     qint64 cacheKey_;
     QImage sourceImage_;
+    QImage downsampledImage_;
     QImage blurredImage_;
+    QImage scaledImage_;
+    QImage unpackedImage_;
+    AtlasLayout sourceLayout_;  ///< packing of sourceImage_
+    AtlasLayout blurredLayout_; ///< packing of blurredImage_
+    QRegion dirtyRegion_; ///< part of sourceImage_ changed since blurredImage_ was made
     QRegion region_;
+    QRegion grabbedRegion_; ///< part of the widget sourceImage_ was made from
     BlurBehindEffect::BlurMethod blurringMethod_;
     Qt::CoordinateSystem coordSystem_;
     QBrush backgroundBrush_;
     double sourceOpacity_;
     double blurOpacity_;
     double downsamplingFactor_;
+    double frameBudget_; ///< in milliseconds, 0 if the quality is not adapted
+    qreal scaledDpr_;
+    quint64 blurGeneration_;
+    quint64 scaledGeneration_;
+    quint64 unpackedGeneration_;
     int blurRadius_;
     int maxThreadCount_;
+    int qualityLevel_; ///< steps the quality controller went below the user settings
+    std::vector<qint64> budgetSamples_; ///< costs of the recent frames that grabbed the source
     bool sourceUpdated_;
+    bool sourceDirty_; ///< sourceImage_ must be grabbed again regardless of the repainted area
+    bool asynchronous_;
+    std::array<RollingSamples, std::size_t(Stage::Count)> stageSamples_;
+    std::array<qint64, std::size_t(Stage::Count)> frameNsecs_; ///< of the frame in progress, -1 if a stage did not run
+    qint64 frameBytes_;
+    qint64 lastFrameBytes_;
+    quint64 frames_;
+    quint64 skippedFrames_;
+    bool frameStarted_;
+    BlurPyramid pyramid_;       ///< of sourceImage_, for animated radii
+    QElapsedTimer radiusTimer_; ///< since the last radius change
+    QTimer settleTimer_;        ///< replaces a blur from the pyramid once the radius stops changing
+    quint64 sourceGeneration_;
+    quint64 blurredSourceGeneration_;
+    bool radiusAnimating_;
+    bool approximateBlur_; ///< blurredImage_ was blended from the pyramid
+    std::deque<std::pair<quint64, AtlasLayout>> glPendingLayouts_; ///< tickets and packings of the submitted GL blurs
+    quint64 glQueuedFrame_; ///< frames_ when the last GL blur was queued
+    QTimer readbackTimer_;  ///< repaints once more to show the last queued GL blur
+    std::unique_ptr<AsyncBlurQueue> asyncQueue_;
 
-    BlurBehindEffectPrivate()
+    explicit BlurBehindEffectPrivate(BlurBehindEffect* _q)
         : cacheKey_(0)
         , blurringMethod_(BlurBehindEffect::BlurMethod::StackBlur)
         , coordSystem_(Qt::LogicalCoordinates)
         , sourceOpacity_(1.0)
         , blurOpacity_(1.0)
         , downsamplingFactor_(2.0)
+        , frameBudget_(0.0)
+        , scaledDpr_(1.0)
+        , blurGeneration_(0)
+        , scaledGeneration_(0)
+        , unpackedGeneration_(0)
         , blurRadius_(2)
         , maxThreadCount_(1)
+        , qualityLevel_(0)
         , sourceUpdated_(true)
+        , sourceDirty_(true)
+        , asynchronous_(false)
+        , frameBytes_(0)
+        , lastFrameBytes_(0)
+        , frames_(0)
+        , skippedFrames_(0)
+        , frameStarted_(false)
+        , sourceGeneration_(0)
+        , blurredSourceGeneration_(0)
+        , radiusAnimating_(false)
+        , approximateBlur_(false)
+        , glQueuedFrame_(0)
     {
+        frameNsecs_.fill(-1);
+
+        settleTimer_.setSingleShot(true);
+        settleTimer_.setInterval(animationInterval());
+        QObject::connect(&settleTimer_, &QTimer::timeout, _q, [this, _q]()
+        {
+            radiusAnimating_ = false;
+            if (!approximateBlur_)
+                return;
+
+            invalidateBlur();
+            Q_EMIT _q->repaintRequired();
+            _q->update();
+        });
+
+        readbackTimer_.setSingleShot(true);
+        readbackTimer_.setInterval(0);
+        QObject::connect(&readbackTimer_, &QTimer::timeout, _q, [_q]()
+        {
+            Q_EMIT _q->repaintRequired();
+            _q->update();
+        });
+
+        // finished blurs are announced in the GUI thread, queued calls
+        // are dropped by Qt if the effect is destroyed in the meantime
+        asyncQueue_ = std::make_unique<AsyncBlurQueue>([_q]()
+        {
+            QMetaObject::invokeMethod(_q, [_q]()
+            {
+                Q_EMIT _q->repaintRequired();
+                _q->update();
+            }, Qt::QueuedConnection);
+        });
     }
 
-    QImage blurImage(const QImage &_input)
+    ~BlurBehindEffectPrivate()
     {
-        switch(blurringMethod_)
+        releaseGlBlur();
+    }
+
+    /// Adds _nsecs to the time _stage took in the current frame
+    void addStageTime(Stage _stage, qint64 _nsecs)
+    {
+        qint64& nsecs = frameNsecs_[std::size_t(_stage)];
+        nsecs = std::max(nsecs, qint64(0)) + _nsecs;
+    }
+
+    /// Counts the buffer of _image if it is not the one at _previousBits
+    void addAllocation(const QImage& _image, const uchar* _previousBits = nullptr)
+    {
+        if (!_image.isNull() && _image.constBits() != _previousBits)
+            frameBytes_ += _image.sizeInBytes();
+    }
+
+    /// Moves the measurements of the current frame to the rolling window,
+    /// returns false if no frame was started since the last call
+    bool finishFrame()
+    {
+        if (!frameStarted_)
+            return false;
+
+        for (std::size_t i = 0; i < frameNsecs_.size(); ++i)
         {
-        case BlurBehindEffect::BlurMethod::BoxBlur:
-            return boxBlurImage(_input, blurRadius_);
-        case BlurBehindEffect::BlurMethod::StackBlur:
-            return stackBlurImage(_input, blurRadius_, maxThreadCount_);
-        case BlurBehindEffect::BlurMethod::GLBlur:
-            return glBlur_.blurImage_DualKawase(_input, 2, std::max(blurRadius_ - 2, 1));
+            if (frameNsecs_[i] >= 0)
+                stageSamples_[i].add(frameNsecs_[i]);
+        }
+        // blurs of the worker thread do not delay the frame
+        const bool grabbed = frameNsecs_[std::size_t(Stage::Grab)] >= 0;
+        qint64 cost = 0;
+        for (std::size_t i = 0; i < frameNsecs_.size(); ++i)
+        {
+            if (frameNsecs_[i] >= 0 && (Stage(i) != Stage::Blur || !isAsynchronous()))
+                cost += frameNsecs_[i];
         }
-        return _input;
+        if (grabbed)
+            adaptQuality(cost);
+
+        frameNsecs_.fill(-1);
+        lastFrameBytes_ = frameBytes_;
+        frameBytes_ = 0;
+        frameStarted_ = false;
+        return true;
     }
 
-    QPixmap grabSource(QWidget* _widget) const
+    //
+    // Quality levels trade the user settings for speed in steps: the thread
+    // count is doubled up to the ideal one, the method is switched to StackBlur,
+    // then every further level downsamples 1.25 times more, shrinking the
+    // radius with it, so the blur keeps its size on screen.
+    //
+
+    static constexpr double downsampleStep() { return 1.25; }
+    static constexpr int downsampleLevels() { return 6; }
+
+    int threadLevels() const
     {
-        if (!_widget)
-            return QPixmap{};
+        int levels = 0;
+        for (int threads = maxThreadCount_; threads < QThread::idealThreadCount(); threads *= 2)
+            ++levels;
+        return levels;
+    }
+
+    int methodLevels() const
+    {
+        return blurringMethod_ == BlurBehindEffect::BlurMethod::StackBlur ? 0 : 1;
+    }
+
+    int qualityLevels() const
+    {
+        return threadLevels() + methodLevels() + downsampleLevels();
+    }
+
+    /// Levels of qualityLevel_ spent on extra downsampling
+    int downsampleLevel() const
+    {
+        return std::clamp(qualityLevel_ - threadLevels() - methodLevels(), 0, downsampleLevels());
+    }
+
+    /// Settings the blur runs with at the current quality level
+    BlurSettings settings() const
+    {
+        const int threadLevel = std::min(qualityLevel_, threadLevels());
+        const bool methodLevel = qualityLevel_ > threadLevel && methodLevels() > 0;
+        const int downsampled = downsampleLevel();
+
+        BlurSettings result{ blurringMethod_, blurRadius_, maxThreadCount_ };
+        // without a usable GL context the CPU port of the same blur runs instead
+        if (result.method == BlurBehindEffect::BlurMethod::GLBlur && !(glBlur_ && glBlur_->isValid()))
+            result.method = BlurBehindEffect::BlurMethod::DualKawaseBlur;
+        if (threadLevel > 0)
+            result.threadCount = std::min(maxThreadCount_ << threadLevel, QThread::idealThreadCount());
+        if (methodLevel)
+            result.method = BlurBehindEffect::BlurMethod::StackBlur;
+        if (downsampled > 0)
+            result.radius = std::max(2, int(std::lround(blurRadius_ / std::pow(downsampleStep(), downsampled))));
+        return result;
+    }
+
+    /// Downsample factor of the current quality level
+    double downsampleFactor() const
+    {
+        return downsamplingFactor_ * std::pow(downsampleStep(), downsampleLevel());
+    }
+
+    /// Moves qualityLevel_ a step when the median cost of the recent frames
+    /// that grabbed the source leaves the frame budget. Raising the quality
+    /// needs a four times longer window at half the budget, so a level that
+    /// just fits is kept instead of oscillating around it.
+    void adaptQuality(qint64 _frameNsecs)
+    {
+        if (frameBudget_ <= 0.0)
+            return;
+
+        constexpr std::size_t degradeWindow = 8;
+        constexpr std::size_t improveWindow = 32;
+        budgetSamples_.push_back(_frameNsecs);
+        if (budgetSamples_.size() > improveWindow)
+            budgetSamples_.erase(budgetSamples_.begin());
+
+        const auto median = [this](std::size_t _count)
+        {
+            std::vector<qint64> samples(budgetSamples_.end() - std::ptrdiff_t(_count), budgetSamples_.end());
+            std::nth_element(samples.begin(), samples.begin() + std::ptrdiff_t(_count / 2), samples.end());
+            return samples[_count / 2];
+        };
+
+        const qint64 budget = qint64(frameBudget_ * 1e6);
+        int level = qualityLevel_;
+        if (budgetSamples_.size() >= degradeWindow && median(degradeWindow) > budget)
+            level = std::min(qualityLevel_ + 1, qualityLevels());
+        else if (budgetSamples_.size() >= improveWindow && median(improveWindow) < budget / 2)
+            level = std::max(qualityLevel_ - 1, 0);
+
+        if (level != qualityLevel_)
+            setQualityLevel(level);
+    }
+
+    void setQualityLevel(int _level)
+    {
+        qualityLevel_ = _level;
+        sourceDirty_ = true;
+        invalidateBlur();
+    }
+
+    /// GL blur needs the GUI thread context, so it is never asynchronous
+    bool isAsynchronous() const
+    {
+        return asynchronous_ && settings().method != BlurBehindEffect::BlurMethod::GLBlur;
+    }
+
+    /// Blurs _input into _output, which is reused between frames to avoid reallocations
+    void blurImage(const QImage &_input, QImage& _output)
+    {
+        blurImageCpu(settings(), stackBlurPlan_, _input, _output);
+    }
+
+    /// Submits the latest source to the GL service and shows the newest blur
+    /// read back so far, usually the one of the previous frame, so the
+    /// readback overlaps the GPU work instead of stalling the frame. A blur
+    /// is waited for only when nothing matching the source is shown yet or
+    /// the source stopped changing, then the last one is the final. The wait
+    /// is bounded, if the GPU does not finish in time the previous blur stays
+    /// shown and the readback timer tries again.
+    void updateGlBlurredImage()
+    {
+        if (sourceUpdated_)
+        {
+            const quint64 ticket = glBlur_->submit(this, sourceImage_, kawaseIterations(settings().radius));
+            glPendingLayouts_.emplace_back(ticket, sourceLayout_);
+            glQueuedFrame_ = frames_;
+            blurredSourceGeneration_ = sourceGeneration_;
+            approximateBlur_ = false;
+            sourceUpdated_ = false;
+            dirtyRegion_ = QRegion();
+        }
 
-        qreal dpr(1.0);
-        if (const auto *paintDevice = _widget)
-            dpr = paintDevice->devicePixelRatioF();
+        const bool stale = blurredImage_.isNull() || blurredImage_.size() != sourceImage_.size() || !(blurredLayout_ == sourceLayout_);
+        takeGlBlur(stale || glQueuedFrame_ != frames_);
+        if (glBlur_->hasPending(this))
+            readbackTimer_.start();
+    }
+
+    /// Moves the newest finished GL blur to blurredImage_
+    void takeGlBlur(bool _wait)
+    {
+        // the service swaps buffers with blurredImage_, like the asynchronous mode
+        const quint64 ticket = glBlur_->take(this, blurredImage_, _wait);
+        while (!glPendingLayouts_.empty() && glPendingLayouts_.front().first < ticket)
+            glPendingLayouts_.pop_front();
+        if (ticket != 0 && !glPendingLayouts_.empty())
+        {
+            blurredLayout_ = std::move(glPendingLayouts_.front().second);
+            glPendingLayouts_.pop_front();
+            blurredImage_.setDevicePixelRatio(sourceImage_.devicePixelRatioF());
+            ++blurGeneration_;
+        }
+        if (!glBlur_->hasPending(this))
+            glPendingLayouts_.clear();
+    }
+
+    /// The GL service and its context are held only while GLBlur is
+    /// selected, effects of the other methods never create them
+    void updateGlBlur()
+    {
+        if (blurringMethod_ != BlurBehindEffect::BlurMethod::GLBlur)
+            releaseGlBlur();
+        else if (!glBlur_)
+            glBlur_ = GLBlurService::instance();
+    }
+
+    void releaseGlBlur()
+    {
+        if (glBlur_)
+            glBlur_->discard(this);
+        glBlur_.reset();
+        glPendingLayouts_.clear();
+    }
+
+    /// Hands the latest source over to the worker in the asynchronous mode
+    void submitSource()
+    {
+        if (!sourceUpdated_ || !isAsynchronous())
+            return;
+
+        asyncQueue_->submit(sourceImage_, settings());
+        sourceUpdated_ = false;
+        dirtyRegion_ = sourceImage_.rect();
+    }
+
+    /// Forces the next render to blur again, e.g. after the blur settings changed
+    void invalidateBlur()
+    {
+        budgetSamples_.clear();
+        asyncQueue_->cancel();
+        if (glBlur_)
+            glBlur_->discard(this);
+        glPendingLayouts_.clear();
+        sourceUpdated_ = true;
+        dirtyRegion_ = sourceImage_.rect();
+    }
+
+    /// Radius changes closer than this in milliseconds are taken as an animation
+    static constexpr int animationInterval() { return 250; }
+
+    /// A radius change shortly after the previous one is animated, its
+    /// frames are blended from the pyramid until the radius settles
+    void noteRadiusChange()
+    {
+        radiusAnimating_ = radiusTimer_.isValid() && radiusTimer_.elapsed() < animationInterval();
+        radiusTimer_.start();
+    }
+
+    /// The pyramid serves animated radii while the source stays the same,
+    /// an atlas is left out, its halos are only as wide as the exact blur
+    bool canUsePyramid() const
+    {
+        return radiusAnimating_
+            && settings().method == BlurBehindEffect::BlurMethod::StackBlur
+            && sourceLayout_.isEmpty()
+            && blurredSourceGeneration_ == sourceGeneration_
+            && !blurredImage_.isNull();
+    }
+
+    /// Stackblur output depends on the source within the radius only, so a
+    /// small change is patched into blurredImage_ instead of blurring it all
+    bool canPatchBlur() const
+    {
+        const BlurSettings current = settings();
+        return current.method == BlurBehindEffect::BlurMethod::StackBlur
+            && !approximateBlur_
+            && dirtyRegion_ != QRegion(sourceImage_.rect())
+            && blurredImage_.size() == sourceImage_.size()
+            && blurredImage_.format() == sourceImage_.format()
+            && stackBlurPlan_
+            && stackBlurPlan_->matches(sourceImage_.size(), current.radius, current.threadCount)
+            && stackBlurPlan_->isExecutable(sourceImage_);
+    }
+
+    /// Blurs the latest source if it changed since the last call, in the
+    /// asynchronous mode picks up the last finished blur instead
+    void updateBlurredImage()
+    {
+        if (isAsynchronous())
+        {
+            submitSource();
+            // layout changes cancel the queue, results always match sourceLayout_
+            qint64 nsecs = 0;
+            if (asyncQueue_->takeResult(blurredImage_, nsecs))
+            {
+                addStageTime(Stage::Blur, nsecs);
+                blurredLayout_ = sourceLayout_;
+                ++blurGeneration_;
+            }
+            return;
+        }
+
+        if (settings().method == BlurBehindEffect::BlurMethod::GLBlur)
+        {
+            if (!sourceUpdated_ && !glBlur_->hasPending(this))
+                return;
+
+            QElapsedTimer timer;
+            timer.start();
+            updateGlBlurredImage();
+            addStageTime(Stage::Blur, timer.nsecsElapsed());
+            return;
+        }
+
+        if (!sourceUpdated_)
+            return;
+
+        QElapsedTimer timer;
+        timer.start();
+        const uchar* previousBits = blurredImage_.constBits();
+        if (canPatchBlur())
+        {
+            stackBlurPlan_->execute(BlurImageRef::constView(sourceImage_), BlurImageRef(blurredImage_), dirtyRegion_);
+            blurredImage_.setDevicePixelRatio(sourceImage_.devicePixelRatioF());
+        }
+        else if (canUsePyramid())
+        {
+            const BlurSettings current = settings();
+            pyramid_.blur(sourceImage_, current.radius, current.threadCount, blurredImage_);
+            approximateBlur_ = true;
+            settleTimer_.start();
+        }
         else
-            qWarning("QtBlurBehindEffect::grabSource: Painter not active");
+        {
+            blurImage(sourceImage_, blurredImage_);
+            approximateBlur_ = false;
+        }
+        blurredSourceGeneration_ = sourceGeneration_;
+        addStageTime(Stage::Blur, timer.nsecsElapsed());
+        addAllocation(blurredImage_, previousBits);
+        blurredLayout_ = sourceLayout_;
+        ++blurGeneration_;
+        sourceUpdated_ = false;
+        dirtyRegion_ = QRegion();
+    }
+
+    /// blurredImage_ laid out like the region bounds, an atlas is unpacked
+    /// once per blurred frame and the gaps between its rects stay transparent
+    const QImage& regionBlurredImage()
+    {
+        if (blurredLayout_.isEmpty() || blurredImage_.isNull())
+            return blurredImage_;
+
+        if (unpackedGeneration_ != blurGeneration_ || unpackedImage_.isNull())
+        {
+            QElapsedTimer timer;
+            timer.start();
+            if (unpackedImage_.size() != blurredLayout_.regionSize || unpackedImage_.format() != blurredImage_.format())
+            {
+                unpackedImage_ = QImage(blurredLayout_.regionSize, blurredImage_.format());
+                addAllocation(unpackedImage_);
+            }
+            unpackedImage_.fill(Qt::transparent);
 
-        const bool isGlBlur = blurringMethod_ == BlurBehindEffect::BlurMethod::GLBlur;
-        QPixmap image(_widget->size() * dpr);
+            const int bytesPerPixel = blurredImage_.depth() / 8;
+            for (const AtlasSlot& slot : blurredLayout_.slots)
+            {
+                for (int y = 0; y < slot.rect.height(); ++y)
+                {
+                    std::memcpy(unpackedImage_.scanLine(slot.rect.y() + y) + slot.rect.x() * bytesPerPixel,
+                                blurredImage_.constScanLine(slot.position.y() + y) + slot.position.x() * bytesPerPixel,
+                                slot.rect.width() * bytesPerPixel);
+                }
+            }
+            unpackedImage_.setDevicePixelRatio(blurredImage_.devicePixelRatioF());
+            unpackedGeneration_ = blurGeneration_;
+            addStageTime(Stage::Upscale, timer.nsecsElapsed());
+        }
+        return unpackedImage_;
+    }
+
+    /// blurredImage_ scaled to _size, the smooth upscale is done once per blurred
+    /// frame, so repainting over unchanged content only composites the cache
+    const QImage& scaledBlurredImage(const QSize& _size)
+    {
+        const QImage& blurred = regionBlurredImage();
+        const qreal dpr = blurred.devicePixelRatioF();
+        if (scaledGeneration_ != blurGeneration_ || scaledImage_.size() != _size || scaledDpr_ != dpr || scaledImage_.isNull())
+        {
+            QElapsedTimer timer;
+            timer.start();
+            scaledImage_ = blurred.scaled(_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            addStageTime(Stage::Upscale, timer.nsecsElapsed());
+            addAllocation(scaledImage_);
+            scaledGeneration_ = blurGeneration_;
+            scaledDpr_ = dpr;
+        }
+        return scaledImage_;
+    }
+
+    /// Packs the region into an atlas for blurring at _size, a different
+    /// packing makes the previous source and the pending blurs useless
+    void updateLayout(const QRect& _bounds, const QSize& _size)
+    {
+        AtlasLayout layout = packAtlas(region_, _bounds, _size, blurSupport(settings()));
+        if (layout == sourceLayout_)
+            return;
+
+        sourceLayout_ = std::move(layout);
+        invalidateBlur();
+    }
+
+    /// Part of the widget sourceLayout_ reads, the rects of an atlas
+    /// mapped back from the downsampled _size of _bounds or the bounds
+    QRegion grabRegion(const QRect& _bounds, const QSize& _size) const
+    {
+        if (sourceLayout_.isEmpty())
+            return QRegion(_bounds);
+
+        const qreal sx = qreal(_bounds.width()) / _size.width();
+        const qreal sy = qreal(_bounds.height()) / _size.height();
+        QRegion region;
+        for (const AtlasSlot& slot : sourceLayout_.slots)
+        {
+            const QRectF rect(_bounds.x() + slot.rect.x() * sx, _bounds.y() + slot.rect.y() * sy,
+                              slot.rect.width() * sx, slot.rect.height() * sy);
+            region += rect.toAlignedRect() & _bounds;
+        }
+        return region;
+    }
+
+    /// Area averages _rect of the grabbed _pixmap into sourceImage_ of _size in
+    /// a single pass, the pixels of raster pixmaps are read in place. Scratch
+    /// buffer is swapped with sourceImage_, so frames do not reallocate.
+    /// With an atlas layout only its rects are downsampled into their slots.
+    /// Returns true if the result differs from the previous frame, changed
+    /// pixels are accumulated in dirtyRegion_ until the next blur.
+    bool downsampleSource(const QPixmap& _pixmap, const QRect& _rect, const QSize& _size)
+    {
+        if (_size.isEmpty())
+            return false;
+
+        QElapsedTimer timer;
+        timer.start();
+        QImage grabbed = _pixmap.toImage();
+        QRect rect = _rect;
+        const bool readable = grabbed.format() == QImage::Format_ARGB32_Premultiplied || grabbed.format() == QImage::Format_RGB32;
+        if (!readable || !grabbed.rect().contains(_rect))
+        {
+            grabbed = grabbed.copy(_rect).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+            addAllocation(grabbed);
+            rect = grabbed.rect();
+        }
+
+        // gaps of an atlas are never written, they stay transparent
+        const QSize size = sourceLayout_.isEmpty() ? _size : sourceLayout_.size;
+        if (downsampledImage_.size() != size || downsampledImage_.format() != QImage::Format_ARGB32_Premultiplied)
+        {
+            downsampledImage_ = QImage(size, QImage::Format_ARGB32_Premultiplied);
+            downsampledImage_.fill(Qt::transparent);
+            addAllocation(downsampledImage_);
+        }
+
+        const int threadCount = BlurPlan::suitableThreadCount(rect.size(), settings().threadCount);
+        if (sourceLayout_.isEmpty())
+        {
+            downsample(BlurImageRef::constView(grabbed).subRect(rect), BlurImageRef(downsampledImage_), threadCount);
+        }
+        else
+        {
+            const qreal sx = qreal(rect.width()) / _size.width();
+            const qreal sy = qreal(rect.height()) / _size.height();
+            for (const AtlasSlot& slot : sourceLayout_.slots)
+            {
+                const QRectF from(slot.rect.x() * sx, slot.rect.y() * sy, slot.rect.width() * sx, slot.rect.height() * sy);
+                const QRect to(slot.position, slot.rect.size());
+                downsample(BlurImageRef::constView(grabbed).subRect(from.toRect().translated(rect.topLeft())),
+                           BlurImageRef(downsampledImage_).subRect(to), threadCount);
+                extendEdges(downsampledImage_, to, sourceLayout_.halo);
+            }
+        }
+        downsampledImage_.setDevicePixelRatio(_pixmap.devicePixelRatioF());
+        addStageTime(Stage::Downsample, timer.restart());
+
+        const bool comparable = downsampledImage_.size() == sourceImage_.size() && downsampledImage_.format() == sourceImage_.format();
+        const QRegion changed = comparable ? changedRegion(downsampledImage_, sourceImage_) : QRegion(downsampledImage_.rect());
+        addStageTime(Stage::ChangeDetect, timer.nsecsElapsed());
+        if (changed.isEmpty())
+            return false;
+
+        // frames without a blur in between add up, patching stays cheap
+        // for a few rects and the bounding rect is patched beyond them
+        dirtyRegion_ |= changed;
+        if (dirtyRegion_.rectCount() > maxDirtyRects())
+            dirtyRegion_ = dirtyRegion_.boundingRect();
+        sourceImage_.swap(downsampledImage_);
+        return true;
+    }
+
+    /// Returns true if the repaint _painter draws can have changed the widget
+    /// under grabbedRegion_. While an effect draws, the paint engine clips to the
+    /// region the widget repaints, so updates elsewhere in the window leave
+    /// sourceImage_ valid and the grab can be skipped. Without that
+    /// information every repaint is considered a change.
+    bool sourceExposed(const QPainter* _painter) const
+    {
+        if (sourceDirty_ || sourceImage_.isNull())
+            return true;
+
+        const QPaintEngine* engine = _painter->paintEngine();
+        const QRegion clip = engine ? engine->systemClip() : QRegion();
+        bool invertible = false;
+        const QTransform toLogical = _painter->deviceTransform().inverted(&invertible);
+        if (clip.isEmpty() || !invertible)
+            return true;
+
+        return toLogical.map(clip).intersects(grabbedRegion_);
+    }
+
+    /// Renders _region of _widget and its children into a pixmap of _rect,
+    /// only the widgets intersecting the region are painted, so the cost
+    /// follows the area of the blur region
+    QPixmap grabSource(QWidget* _widget, const QRect& _rect, const QRegion& _region) const
+    {
+        if (!_widget || _rect.isEmpty())
+            return QPixmap{};
+
+        const qreal dpr = _widget->devicePixelRatioF();
+        const bool isGlBlur = settings().method == BlurBehindEffect::BlurMethod::GLBlur;
+        QPixmap image(_rect.size() * dpr);
         image.setDevicePixelRatio(dpr);
         image.fill(isGlBlur ? _widget->palette().color(_widget->backgroundRole()) : Qt::transparent);
-        _widget->render(&image, {}, {}, QWidget::DrawChildren);
+        _widget->render(&image, _region.boundingRect().topLeft() - _rect.topLeft(), _region, QWidget::DrawChildren);
 
         return image;
     }
@@ -101,7 +1279,7 @@ public:
 
 BlurBehindEffect::BlurBehindEffect(QWidget* _parent)
     : QGraphicsEffect(_parent)
-    , d(std::make_unique<BlurBehindEffectPrivate>())
+    , d(std::make_unique<BlurBehindEffectPrivate>(this))
 {
 }
 
@@ -164,6 +1342,9 @@ void BlurBehindEffect::setBlurMethod(BlurBehindEffect::BlurMethod _method)
         return;
 
     d->blurringMethod_ = _method;
+    d->updateGlBlur();
+    d->sourceDirty_ = true;
+    d->invalidateBlur();
     Q_EMIT repaintRequired();
     update();
 }
@@ -175,7 +1356,11 @@ BlurBehindEffect::BlurMethod BlurBehindEffect::blurMethod() const
 
 void BlurBehindEffect::setRegion(const QRegion& _sourceRegion)
 {
+    if (d->region_ == _sourceRegion)
+        return;
+
     d->region_ = _sourceRegion;
+    d->sourceDirty_ = true;
     updateBoundingRect();
 }
 
@@ -190,6 +1375,11 @@ void BlurBehindEffect::setBlurRadius(int _radius)
         return;
 
     d->blurRadius_ = _radius;
+    d->noteRadiusChange();
+    // atlas halos follow the radius, a plain source is still valid
+    if (!d->sourceLayout_.isEmpty())
+        d->sourceDirty_ = true;
+    d->invalidateBlur();
     Q_EMIT blurRadiusChanged(_radius);
     Q_EMIT repaintRequired();
 
@@ -209,6 +1399,7 @@ void BlurBehindEffect::setDownsampleFactor(double _factor)
         return;
 
     d->downsamplingFactor_ = _factor;
+    d->sourceDirty_ = true;
     Q_EMIT downsampleFactorChanged(_factor);
     Q_EMIT repaintRequired();
 
@@ -230,6 +1421,43 @@ int BlurBehindEffect::maxThreadCount() const
     return d->maxThreadCount_;
 }
 
+void BlurBehindEffect::setAsynchronous(bool _asynchronous)
+{
+    if (d->asynchronous_ == _asynchronous)
+        return;
+
+    d->asynchronous_ = _asynchronous;
+    d->invalidateBlur();
+    Q_EMIT repaintRequired();
+    update();
+}
+
+bool BlurBehindEffect::isAsynchronous() const
+{
+    return d->asynchronous_;
+}
+
+void BlurBehindEffect::setFrameBudget(double _milliseconds)
+{
+    _milliseconds = std::max(_milliseconds, 0.0);
+    if (d->frameBudget_ == _milliseconds)
+        return;
+
+    d->frameBudget_ = _milliseconds;
+    if (d->qualityLevel_ != 0 && _milliseconds == 0.0)
+    {
+        d->setQualityLevel(0);
+        Q_EMIT repaintRequired();
+        update();
+    }
+    d->budgetSamples_.clear();
+}
+
+double BlurBehindEffect::frameBudget() const
+{
+    return d->frameBudget_;
+}
+
 void BlurBehindEffect::setCoordinateSystem(Qt::CoordinateSystem _system)
 {
     if (d->coordSystem_ == _system)
@@ -251,15 +1479,33 @@ void BlurBehindEffect::draw(QPainter* _painter)
     if (!w)
         return;
 
+    // the previous frame ends here, its render() calls are done,
+    // the quality controller may change the settings of this one
+    if (d->finishFrame())
+        Q_EMIT statisticsUpdated();
+
     const QRect bounds = d->region_.boundingRect();
+    const bool blurring = !d->region_.isEmpty() && d->blurRadius_ > 1;
+    const bool grab = blurring && d->sourceExposed(_painter);
+    if (!blurring)
+        d->sourceDirty_ = true;
 
-    // grap widget source pixmap
-    QPixmap pixmap = d->grabSource(w);
-    // render source
-    _painter->drawPixmap(0, 0, pixmap);
+    if (blurring)
+    {
+        d->frameStarted_ = true;
+        ++d->frames_;
+        if (!grab)
+            ++d->skippedFrames_;
+    }
 
+    // render source, the translucent pass draws the same pixmap
+    // again, so the widget is rendered only once in both cases
     if (d->sourceOpacity_ > 0.0 && d->sourceOpacity_ < 1.0)
     {
+        QPoint offset;
+        const QPixmap source = sourcePixmap(Qt::LogicalCoordinates, &offset, QGraphicsEffect::NoPad);
+        _painter->drawPixmap(offset, source);
+
         if (!d->region_.isEmpty() && bounds != w->rect())
             _painter->setClipRegion(QRegion(w->rect()) -= d->region_);
         else if (!d->region_.isEmpty())
@@ -267,23 +1513,41 @@ void BlurBehindEffect::draw(QPainter* _painter)
 
         const double opacity = _painter->opacity();
         _painter->setOpacity(d->sourceOpacity_);
-        _painter->drawPixmap(0, 0, pixmap);
+        _painter->drawPixmap(offset, source);
         _painter->setOpacity(opacity);
     }
+    else
+    {
+        drawSource(_painter);
+    }
 
-    // get image blur region and downsample it
-    if (!d->region_.isEmpty() && d->blurRadius_ > 1)
+    // grab blur region and downsample it, pixels outside the region
+    // are never sampled, the blur clamps to its edges
+    if (grab)
     {
-        const double dpr = pixmap.devicePixelRatioF();
-        const QSize s = (QSizeF(bounds.size()) * dpr / d->downsamplingFactor_).toSize();
-        const QRect r{ bounds.topLeft() * dpr, bounds.size() * dpr };
-        QImage pixmapPart = pixmap.copy(r).scaled(s, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).toImage();
-        if (d->sourceImage_ != pixmapPart)
+        const double dpr = w->devicePixelRatioF();
+        const QSize s = (QSizeF(bounds.size()) * dpr / d->downsampleFactor()).toSize();
+        d->updateLayout(bounds, s);
+        d->grabbedRegion_ = d->grabRegion(bounds, s);
+        QElapsedTimer timer;
+        timer.start();
+        const QPixmap pixmap = d->grabSource(w, bounds, d->grabbedRegion_);
+        d->addStageTime(Stage::Grab, timer.nsecsElapsed());
+        d->frameBytes_ += qint64(pixmap.width()) * pixmap.height() * pixmap.depth() / 8;
+        if (d->downsampleSource(pixmap, pixmap.rect(), s))
         {
-            d->sourceImage_ = pixmapPart;
-            d->cacheKey_ = pixmapPart.cacheKey();
+            d->cacheKey_ = d->sourceImage_.cacheKey();
             d->sourceUpdated_ = true;
+            ++d->sourceGeneration_;
+            d->pyramid_.reset();
         }
+        else
+        {
+            ++d->skippedFrames_;
+        }
+        d->sourceDirty_ = false;
+        // start blurring while the rest of the window is painted
+        d->submitSource();
     }
 }
 
@@ -292,12 +1556,13 @@ void BlurBehindEffect::render(QPainter* _painter)
     if (blurRadius() <= 1 || d->sourceImage_.isNull())
         return;
 
-    if (!d->sourceUpdated_)
-        return d->renderImage(_painter, d->blurredImage_, d->backgroundBrush_);
+    d->updateBlurredImage();
+    const QImage& image = d->regionBlurredImage();
 
-    d->blurredImage_ = d->blurImage(d->sourceImage_);
-    d->renderImage(_painter, d->blurredImage_, d->backgroundBrush_);
-    d->sourceUpdated_ = false;
+    QElapsedTimer timer;
+    timer.start();
+    d->renderImage(_painter, image, d->backgroundBrush_);
+    d->addStageTime(Stage::Composite, timer.nsecsElapsed());
 }
 
 void BlurBehindEffect::render(QPainter* _painter, const QPainterPath& _clipPath)
@@ -317,16 +1582,44 @@ void BlurBehindEffect::render(QPainter* _painter, const QPainterPath& _clipPath)
         return;
     }
 
-    if (d->sourceUpdated_)
-    {
-        d->blurredImage_ = d->blurImage(d->sourceImage_);
-        d->sourceUpdated_ = false;
-    }
+    d->updateBlurredImage();
+    if (d->blurredImage_.isNull())
+        return;
 
     const auto dpr = d->blurredImage_.devicePixelRatioF();
-    const QRectF targetRect{ targetBounds.topLeft() * dpr, targetBounds.size() * dpr };
+    const QRectF targetRect{ (targetBounds.topLeft() - regionRect.topLeft()) * dpr, targetBounds.size() * dpr };
+
+    const QImage& image = d->scaledBlurredImage(regionRect.size() * dpr);
 
-    QImage image = d->blurredImage_.scaled(regionRect.size() * dpr, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    QElapsedTimer timer;
+    timer.start();
     _painter->setOpacity(d->blurOpacity_);
     _painter->drawImage(QPointF{}, image, targetRect);
+    d->addStageTime(Stage::Composite, timer.nsecsElapsed());
+}
+
+BlurBehindEffect::Statistics BlurBehindEffect::statistics() const
+{
+    Statistics statistics;
+    StageTimings* stages[] = { &statistics.grab, &statistics.downsample, &statistics.changeDetect,
+                               &statistics.blur, &statistics.upscale, &statistics.composite };
+    static_assert(sizeof(stages) / sizeof(stages[0]) == std::size_t(Stage::Count), "every stage needs a field");
+
+    for (std::size_t i = 0; i < d->stageSamples_.size(); ++i)
+        *stages[i] = d->stageSamples_[i].timings();
+    statistics.bytesAllocated = d->lastFrameBytes_;
+    statistics.frames = d->frames_;
+    statistics.skippedFrames = d->skippedFrames_;
+    return statistics;
+}
+
+void BlurBehindEffect::resetStatistics()
+{
+    d->stageSamples_.fill(RollingSamples());
+    d->frameNsecs_.fill(-1);
+    d->frameBytes_ = 0;
+    d->lastFrameBytes_ = 0;
+    d->frames_ = 0;
+    d->skippedFrames_ = 0;
+    d->frameStarted_ = false;
 }
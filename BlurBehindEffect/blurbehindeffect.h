@@ -12,16 +12,48 @@ class BlurBehindEffect :
     Q_PROPERTY(double sourceOpacity READ sourceOpacity WRITE setSourceOpacity NOTIFY sourceOpacityChanged)
     Q_PROPERTY(double downsampleFactor READ downsampleFactor WRITE setDownsampleFactor NOTIFY downsampleFactorChanged)
     Q_PROPERTY(QBrush backgroundBrush READ backgroundBrush WRITE setBackgroundBrush NOTIFY backgroundBrushChanged)
+    Q_PROPERTY(bool asynchronous READ isAsynchronous WRITE setAsynchronous)
+    Q_PROPERTY(double frameBudget READ frameBudget WRITE setFrameBudget)
 
 public:
+    /// GLBlur falls back to DualKawaseBlur, its CPU port, where no
+    /// OpenGL 3.3 context can be created
     enum class BlurMethod
     {
         BoxBlur,
         StackBlur,
-        GLBlur
+        GLBlur,
+        SlidingBoxBlur,
+        DualKawaseBlur
     };
     Q_ENUM(BlurMethod)
 
+    /// Durations of a single stage in milliseconds, percentiles are taken
+    /// over the frames of the rolling window the stage ran in
+    struct StageTimings
+    {
+        double last = 0.0;
+        double median = 0.0;
+        double p90 = 0.0;
+        double p99 = 0.0;
+        int samples = 0;
+    };
+
+    /// Per frame costs of the effect, a frame starts with draw() and includes
+    /// the render() calls made before the next one
+    struct Statistics
+    {
+        StageTimings grab;          ///< rendering the widget under the region
+        StageTimings downsample;    ///< scaling the grab into the blur source
+        StageTimings changeDetect;  ///< comparing the source with the previous frame
+        StageTimings blur;          ///< blurring, in the worker thread in the asynchronous mode
+        StageTimings upscale;       ///< unpacking and scaling the blur for render()
+        StageTimings composite;     ///< painting the blur in render()
+        qint64 bytesAllocated = 0;  ///< image buffers allocated by the last frame
+        quint64 frames = 0;
+        quint64 skippedFrames = 0;  ///< frames that reused the previous blur
+    };
+
     BlurBehindEffect(QWidget* _parent = nullptr);
     ~BlurBehindEffect();
 
@@ -52,9 +84,29 @@ public:
     void setMaxThreadCount(int _nthreads);
     int maxThreadCount() const;
 
+    /// Blurs in a worker thread instead of the paint event, render() shows the
+    /// last finished blur and repaintRequired() is emitted when a newer one is
+    /// ready. GLBlur never uses the worker, it needs the GUI thread context,
+    /// its blurs are read back a frame later in both modes instead.
+    void setAsynchronous(bool _asynchronous);
+    bool isAsynchronous() const;
+
+    /// Frame time in milliseconds the effect tries to stay within, measured
+    /// like statistics() in the GUI thread. Over budget the thread count is
+    /// raised up to the ideal one, the method switched to StackBlur and the
+    /// source downsampled more, under half of it the steps are taken back.
+    /// The getters keep returning the configured values, 0 disables it.
+    void setFrameBudget(double _milliseconds);
+    double frameBudget() const;
+
     void setCoordinateSystem(Qt::CoordinateSystem _system);
     Qt::CoordinateSystem coordinateSystem() const;
 
+    /// Timings of the recent frames, statisticsUpdated() is emitted when a frame
+    /// is complete, which is known when the next one starts
+    Statistics statistics() const;
+    void resetStatistics();
+
 protected:
     void draw(QPainter *_painter) Q_DECL_OVERRIDE;
 
@@ -65,6 +117,7 @@ Q_SIGNALS:
     void downsampleFactorChanged(double);
     void backgroundBrushChanged(const QBrush&);
     void repaintRequired();
+    void statisticsUpdated();
 
 private:
     std::unique_ptr<class BlurBehindEffectPrivate> d;
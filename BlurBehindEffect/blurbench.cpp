@@ -0,0 +1,541 @@
+#include "blur.h"
+#include "stackblur_p.h"
+#include "glblurfunctions.h"
+#include "blurtest_p.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <QImage>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QGuiApplication>
+
+//
+// Blur benchmark suite.
+//
+// Runs every blur method over a matrix of images, sizes, formats, radii and
+// thread counts and prints CSV with min/median/p99 timings and throughput.
+// Output of every run is checksummed: checksums must not depend on the thread
+// count or the kernel and must match the golden file, so an optimization can
+// never silently change the output. Unknown combinations, e.g. of the sample
+// images whose decoded pixels depend on the JPEG decoder, are appended to the
+// golden file and reported as "new", which fails the run unless --allow-new
+// is given, so a run never passes without comparing every output.
+//
+// --per-pass times the horizontal and vertical stackblur passes of every
+// supported kernel separately instead, single threaded, over the selected
+// sizes and radii, and fails if a kernel output differs from the scalar one.
+// The scalar rows are the column at a time baseline of the blocked vertical
+// pass of the SIMD kernels.
+//
+// The "gl" method is not run by default, it needs a GUI application and an
+// OpenGL 3.3 context. It runs on the "offscreen" platform unless
+// QT_QPA_PLATFORM says otherwise, which creates its contexts through GLX, so
+// a headless machine runs it under Xvfb with Mesa llvmpipe. Its output is
+// compared with the CPU "kawase" port instead of the golden file, GPUs
+// round differently from one another, one step per pass at most.
+//
+// Options (comma separated lists):
+//   --methods=box,stack,...    --sizes=256x256,1920x1080,...   --radii=4,16
+//   --threads=1,8              --formats=argb32pm,rgb32,alpha8 --images=synthetic,gray
+//   --runs=7                   --golden=<file>                 --allow-new
+//   --methods=kawase,gl        compares the GL blur with its CPU port
+//   --per-pass                 per-pass stackblur kernel timings
+//
+
+namespace
+{
+    struct Method
+    {
+        const char* name;
+        std::function<bool(QImage::Format)> supported;
+        std::function<QImage(const QImage&, int, int)> run; ///< (image, radius, threads)
+        const char* reference = nullptr;      ///< method the output is compared with instead of the golden file
+        std::function<int(int)> tolerance;    ///< largest channel difference to the reference at a radius
+    };
+
+    struct Format
+    {
+        const char* name;
+        QImage::Format format;
+    };
+
+    bool isSingleChannel(QImage::Format _format)
+    {
+        return _format == QImage::Format_Alpha8 || _format == QImage::Format_Grayscale8;
+    }
+
+    /// Stackblur with an explicitly selected kernel
+    Method stackKernelMethod(const char* _name, StackBlurKernel _kernel)
+    {
+        return { _name,
+                 [=](QImage::Format _format) { return stackblurKernelSupported(_kernel) && !isSingleChannel(_format); },
+                 [=](const QImage& _image, int _radius, int _threads) {
+                     QImage result = _image.copy();
+                     stackblur(result.bits(), result.width(), result.height(), result.bytesPerLine(), _radius, _threads, _kernel);
+                     return result;
+                 } };
+    }
+
+    /// 3 channel pass of the kernel, which skips the alpha of opaque images
+    Method stackRgb32Method(const char* _name, StackBlurKernel _kernel)
+    {
+        return { _name,
+                 [=](QImage::Format _format) { return stackblurKernelSupported(_kernel) && _format == QImage::Format_RGB32; },
+                 [=](const QImage& _image, int _radius, int _threads) {
+                     QImage result = _image.copy();
+                     stackblur(result.bits(), result.width(), result.height(), result.bytesPerLine(), _radius, _threads,
+                               stackblurKernelJob_rgb32(_kernel));
+                     return result;
+                 } };
+    }
+
+    /// Iterations grow with log2 of the radius, so the blur extent is comparable
+    int kawaseIterations(int _radius)
+    {
+        int iterations = 1;
+        while ((4 << iterations) <= _radius)
+            ++iterations;
+        return iterations;
+    }
+
+    /// _gl is null when the GL blur is unavailable or was not asked for
+    std::vector<Method> methods(GLBlurFunctions* _gl)
+    {
+        const auto always = [](QImage::Format) { return true; };
+        const auto argbOnly = [](QImage::Format _format) { return !isSingleChannel(_format); };
+        return {
+            { "box", always, [](const QImage& _image, int _radius, int) { return boxBlurImage(_image, _radius); } },
+            { "stack", always, [](const QImage& _image, int _radius, int _threads) { return stackBlurImage(_image, _radius, _threads); } },
+            stackKernelMethod("stack_scalar", StackBlurKernel::Scalar),
+            stackKernelMethod("stack_sse2", StackBlurKernel::SSE2),
+            stackKernelMethod("stack_sse41", StackBlurKernel::SSE41),
+            stackKernelMethod("stack_avx2", StackBlurKernel::AVX2),
+            stackRgb32Method("stack_rgb32", StackBlurKernel::Scalar),
+            stackRgb32Method("stack_rgb32_sse2", StackBlurKernel::SSE2),
+            stackRgb32Method("stack_rgb32_sse41", StackBlurKernel::SSE41),
+            stackRgb32Method("stack_rgb32_avx2", StackBlurKernel::AVX2),
+            { "stack_plan", argbOnly, [](const QImage& _image, int _radius, int _threads) {
+                  // plan creation is a one time cost, it is not measured
+                  static std::map<std::string, std::unique_ptr<BlurPlan>> plans;
+                  std::unique_ptr<BlurPlan>& plan = plans[std::to_string(_image.width()) + 'x' + std::to_string(_image.height())];
+                  if (!plan || !plan->matches(_image.size(), _radius, _threads))
+                      plan = std::make_unique<BlurPlan>(_image.size(), _radius, _threads);
+                  QImage result;
+                  plan->execute(_image, result);
+                  return result;
+              } },
+            { "sliding", always, [](const QImage& _image, int _radius, int _threads) { return slidingBoxBlurImage(_image, _radius, 3, _threads); } },
+            { "kawase", argbOnly, [](const QImage& _image, int _radius, int _threads) {
+                  return kawaseBlurImage(_image, 2, kawaseIterations(_radius), _threads);
+              } },
+            // upload, passes and readback, the GPU runs at its own thread count.
+            // GPUs filter with fewer fraction bits than the CPU port, so every
+            // pass may round a level one step off: Mesa llvmpipe stays within
+            // iterations + 1 for 1 to 6 iterations
+            { "gl", [=](QImage::Format _format) { return _gl && !isSingleChannel(_format); },
+              [=](const QImage& _image, int _radius, int) {
+                  QImage result;
+                  _gl->blurImage_DualKawase(_image, 2, kawaseIterations(_radius), result);
+                  return result;
+              },
+              "kawase", [](int _radius) { return 2 * kawaseIterations(_radius); } },
+        };
+    }
+
+    const Format formats[] = {
+        { "argb32pm", QImage::Format_ARGB32_Premultiplied },
+        { "rgb32", QImage::Format_RGB32 },
+        { "alpha8", QImage::Format_Alpha8 },
+    };
+
+    /// Deterministic gradient with some noise, so that blur has real work to do
+    QImage syntheticImage(const QSize& _size)
+    {
+        QImage image(_size, QImage::Format_ARGB32_Premultiplied);
+        quint32 seed = 0x12345678;
+        for (int y = 0; y < image.height(); ++y)
+        {
+            QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+            for (int x = 0; x < image.width(); ++x)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                const int noise = (seed >> 24) & 0x3f;
+                line[x] = qRgba((x * 255 / image.width() + noise) & 0xff, (y * 255 / image.height()) & 0xff, noise * 4, 255);
+            }
+        }
+        return image;
+    }
+
+    /// Converts premultiplied _image to _format, single channel formats take
+    /// the green channel, so that masks are not constant for opaque images
+    QImage formatImage(const QImage& _image, QImage::Format _format)
+    {
+        if (!isSingleChannel(_format))
+            return _image.convertToFormat(_format);
+
+        QImage image(_image.size(), _format);
+        for (int y = 0; y < image.height(); ++y)
+        {
+            const QRgb* src = reinterpret_cast<const QRgb*>(_image.constScanLine(y));
+            uchar* dst = image.scanLine(y);
+            for (int x = 0; x < image.width(); ++x)
+                dst[x] = uchar(qGreen(src[x]));
+        }
+        return image;
+    }
+
+    /// FNV-1a over visible pixel bytes, padding of scanlines is ignored
+    quint64 checksum(const QImage& _image)
+    {
+        quint64 hash = Q_UINT64_C(14695981039346656037);
+        const int bytes = _image.width() * _image.depth() / 8;
+        for (int y = 0; y < _image.height(); ++y)
+        {
+            const uchar* line = _image.constScanLine(y);
+            for (int i = 0; i < bytes; ++i)
+                hash = (hash ^ line[i]) * Q_UINT64_C(1099511628211);
+        }
+        return hash;
+    }
+
+    std::string hex(quint64 _value)
+    {
+        char buffer[17];
+        std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(_value));
+        return buffer;
+    }
+
+    /// Nearest-rank percentile of sorted samples
+    double percentile(const std::vector<double>& _sorted, double _p)
+    {
+        const std::size_t rank = std::size_t(std::ceil(_p * _sorted.size()));
+        return _sorted[std::clamp<std::size_t>(rank, 1, _sorted.size()) - 1];
+    }
+
+    std::vector<std::string> split(const std::string& _list)
+    {
+        std::vector<std::string> items;
+        std::stringstream stream(_list);
+        for (std::string item; std::getline(stream, item, ',');)
+            if (!item.empty())
+                items.push_back(item);
+        return items;
+    }
+
+    bool contains(const std::vector<std::string>& _list, const char* _item)
+    {
+        return std::find(_list.begin(), _list.end(), _item) != _list.end();
+    }
+
+    struct PassKernel
+    {
+        const char* name;
+        StackBlurJob job;
+        const char* layout; ///< of the vertical pass, the scalar column at a time one is the baseline
+    };
+
+    /// The scalar kernel walks one column at a time, the state before the SIMD
+    /// kernels moved to blocks of adjacent columns
+    const char* passLayout(StackBlurKernel _kernel)
+    {
+        return _kernel == StackBlurKernel::Scalar ? "column at a time (before)" : "column blocks (after)";
+    }
+
+    /// Best of _runs runs of a single stackblur pass in milliseconds
+    double passTime(const QImage& _image, StackBlurJob _job, int _radius, int _step, int _runs)
+    {
+        QImage image = _image.copy();
+        std::vector<unsigned char> stack(stackblurStackSize(_radius));
+
+        QElapsedTimer timer;
+        double best = std::numeric_limits<double>::max();
+        for (int run = 0; run < _runs; ++run)
+        {
+            std::memcpy(image.bits(), _image.constBits(), std::size_t(image.sizeInBytes()));
+            timer.start();
+            _job(image.bits(), image.width(), image.height(), image.bytesPerLine(), _radius, 1, 0, _step, stack.data());
+            best = std::min(best, timer.nsecsElapsed() / 1e6);
+        }
+        return best;
+    }
+
+    /// Per-pass timings of every supported stackblur kernel, returns false
+    /// if a kernel output differs from the one of the scalar kernel
+    bool runPasses(const std::vector<std::string>& _sizes, const std::vector<std::string>& _radii, int _runs, QTextStream& _out)
+    {
+        std::vector<PassKernel> kernels;
+        const std::pair<const char*, StackBlurKernel> available[] = {
+            { "scalar", StackBlurKernel::Scalar }, { "sse2", StackBlurKernel::SSE2 },
+            { "sse41", StackBlurKernel::SSE41 }, { "avx2", StackBlurKernel::AVX2 },
+        };
+        for (const auto& kernel : available)
+        {
+            if (stackblurKernelSupported(kernel.second))
+                kernels.push_back({ kernel.first, stackblurKernelJob(kernel.second), passLayout(kernel.second) });
+        }
+        const std::size_t argbKernels = kernels.size();
+        const char* rgb32Names[] = { "rgb32_scalar", "rgb32_sse2", "rgb32_sse41", "rgb32_avx2" };
+        for (std::size_t i = 0; i < std::size(available); ++i)
+        {
+            if (stackblurKernelSupported(available[i].second))
+                kernels.push_back({ rgb32Names[i], stackblurKernelJob_rgb32(available[i].second), passLayout(available[i].second) });
+        }
+
+        bool exact = true;
+        _out << "kernel,vertical_pass,width,height,radius,horizontal_ms,vertical_ms" << '\n';
+        for (const std::string& sizeName : _sizes)
+        {
+            int width = 0, height = 0;
+            if (std::sscanf(sizeName.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                continue;
+
+            const QImage image = syntheticImage(QSize(width, height));
+            for (const std::string& radiusName : _radii)
+            {
+                const int radius = std::atoi(radiusName.c_str());
+                QImage reference;
+                for (std::size_t k = 0; k < kernels.size(); ++k)
+                {
+                    const PassKernel& kernel = kernels[k];
+                    // the scalar kernel of each pixel layout comes first
+                    QImage result = image.copy();
+                    stackblur(result.bits(), width, height, result.bytesPerLine(), radius, 1, kernel.job);
+                    if (k == 0 || k == argbKernels)
+                        reference = result;
+                    else if (result != reference)
+                    {
+                        qWarning("%s kernel output differs from the scalar one at %s radius %d", kernel.name, sizeName.c_str(), radius);
+                        exact = false;
+                    }
+
+                    _out << kernel.name << ',' << kernel.layout << ',' << width << ',' << height << ',' << radius << ','
+                         << passTime(image, kernel.job, radius, 1, _runs) << ','
+                         << passTime(image, kernel.job, radius, 2, _runs) << '\n';
+                }
+            }
+        }
+        return exact;
+    }
+
+    /// Golden checksums keyed by "method,image,format,WxH,radius"
+    class GoldenFile
+    {
+    public:
+        explicit GoldenFile(const std::string& _path) : path_(_path)
+        {
+            std::ifstream in(_path);
+            for (std::string line; std::getline(in, line);)
+            {
+                if (line.empty() || line[0] == '#')
+                    continue;
+                const std::size_t comma = line.rfind(',');
+                if (comma != std::string::npos)
+                    checksums_[line.substr(0, comma)] = line.substr(comma + 1);
+            }
+        }
+
+        /// Returns "ok", "new" or "MISMATCH"
+        const char* check(const std::string& _key, const std::string& _checksum)
+        {
+            const auto it = checksums_.find(_key);
+            if (it == checksums_.end())
+            {
+                checksums_[_key] = _checksum;
+                added_.push_back(_key);
+                return "new";
+            }
+            return it->second == _checksum ? "ok" : "MISMATCH";
+        }
+
+        int addedCount() const
+        {
+            return int(added_.size());
+        }
+
+        /// Appends the checksums of the unknown combinations
+        void save() const
+        {
+            if (added_.empty())
+                return;
+
+            std::ofstream out(path_, std::ios::app);
+            for (const std::string& key : added_)
+                out << key << ',' << checksums_.at(key) << '\n';
+        }
+
+    private:
+        std::string path_;
+        std::map<std::string, std::string> checksums_;
+        std::vector<std::string> added_;
+    };
+}
+
+int main(int argc, char** argv)
+{
+    const int idealThreads = std::max(QThread::idealThreadCount(), 1);
+    std::map<std::string, std::string> options = {
+        { "methods", "box,stack,stack_scalar,stack_sse2,stack_sse41,stack_avx2,stack_rgb32,stack_rgb32_sse2,stack_rgb32_sse41,stack_rgb32_avx2,stack_plan,sliding,kawase" },
+        { "sizes", "256x256,1280x720,1920x1080,3840x2160,7680x4320" },
+        { "radii", "4,16,64" },
+        { "threads", idealThreads > 1 ? "1," + std::to_string(idealThreads) : "1" },
+        { "formats", "argb32pm,rgb32,alpha8" },
+        { "images", "synthetic,gray,testlist" },
+        { "runs", "7" },
+        { "golden", BLUR_BENCH_SOURCE_DIR "/blurbench_golden.csv" },
+        { "samples", BLUR_BENCH_SOURCE_DIR "/../SampleImages" },
+    };
+    bool allowNew = false;
+    bool perPass = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const std::size_t eq = arg.find('=');
+        if (arg == "--allow-new")
+            allowNew = true;
+        else if (arg == "--per-pass")
+            perPass = true;
+        else if (arg.compare(0, 2, "--") == 0 && eq != std::string::npos && options.count(arg.substr(2, eq - 2)))
+            options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        else
+        {
+            qWarning("unknown option %s", argv[i]);
+            return 2;
+        }
+    }
+
+    const int runs = std::max(std::atoi(options["runs"].c_str()), 1);
+    if (perPass)
+    {
+        QTextStream out(stdout);
+        return runPasses(split(options["sizes"]), split(options["radii"]), runs, out) ? 0 : 1;
+    }
+
+    const std::vector<std::string> methodNames = split(options["methods"]);
+
+    // the GL context needs a GUI application, the CPU methods run without one
+    std::unique_ptr<QGuiApplication> application;
+    std::unique_ptr<GLBlurFunctions> gl;
+    if (contains(methodNames, "gl"))
+    {
+        if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        application = std::make_unique<QGuiApplication>(argc, argv);
+        gl = std::make_unique<GLBlurFunctions>();
+        if (!gl->isValid())
+        {
+            qWarning("GL blur is unavailable, gl is skipped");
+            gl.reset();
+        }
+    }
+    const std::vector<Method> allMethods = methods(gl.get());
+    const std::vector<std::string> formatNames = split(options["formats"]);
+    GoldenFile golden(options["golden"]);
+    QTextStream out(stdout);
+    bool exact = true;
+
+    out << "method,image,format,width,height,radius,threads,min_ms,median_ms,p99_ms,mpix_s,checksum,golden" << '\n';
+    for (const std::string& imageName : split(options["images"]))
+    {
+        QImage sample;
+        if (imageName != "synthetic" && !sample.load((options["samples"] + '/' + imageName + ".jpg").c_str()))
+        {
+            qWarning("failed to load sample image %s", imageName.c_str());
+            continue;
+        }
+
+        for (const std::string& sizeName : split(options["sizes"]))
+        {
+            int width = 0, height = 0;
+            if (std::sscanf(sizeName.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                continue;
+
+            const QSize size(width, height);
+            const QImage source = sample.isNull() ? syntheticImage(size)
+                                                  : sample.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+                                                          .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+            for (const Format& format : formats)
+            {
+                if (!contains(formatNames, format.name))
+                    continue;
+
+                const QImage image = formatImage(source, format.format);
+                for (const std::string& radiusName : split(options["radii"]))
+                {
+                    const int radius = std::atoi(radiusName.c_str());
+                    for (const Method& method : allMethods)
+                    {
+                        if (!contains(methodNames, method.name) || !method.supported(format.format))
+                            continue;
+
+                        // output must not depend on the thread count, kernel checksums
+                        // are compared to the scalar one through the shared golden key
+                        const std::string methodKey = std::strncmp(method.name, "stack", 5) == 0 ? "stack" : method.name;
+                        const std::string key = methodKey + ',' + imageName + ',' + format.name + ',' + sizeName + ',' + std::to_string(radius);
+
+                        for (const std::string& threadsName : split(options["threads"]))
+                        {
+                            const int threads = std::max(std::atoi(threadsName.c_str()), 1);
+
+                            std::vector<double> times;
+                            QImage result;
+                            QElapsedTimer timer;
+                            for (int run = 0; run < runs; ++run)
+                            {
+                                timer.start();
+                                result = method.run(image, radius, threads);
+                                times.push_back(timer.nsecsElapsed() / 1e6);
+                            }
+                            std::sort(times.begin(), times.end());
+
+                            const std::string sum = hex(checksum(result));
+                            const char* status = "ok";
+                            if (method.reference)
+                            {
+                                const auto reference = std::find_if(allMethods.begin(), allMethods.end(), [&](const Method& _m) {
+                                    return std::strcmp(_m.name, method.reference) == 0;
+                                });
+                                const int difference = maxDifference(result, reference->run(image, radius, 1));
+                                if (difference > method.tolerance(radius))
+                                {
+                                    qWarning("%s differs from %s by %d at %s", method.name, method.reference, difference, key.c_str());
+                                    status = "MISMATCH";
+                                }
+                            }
+                            else
+                            {
+                                status = golden.check(key, sum);
+                            }
+                            if (std::strcmp(status, "MISMATCH") == 0 || (std::strcmp(status, "new") == 0 && !allowNew))
+                                exact = false;
+
+                            const double median = percentile(times, 0.5);
+                            out << method.name << ',' << imageName.c_str() << ',' << format.name << ','
+                                << width << ',' << height << ',' << radius << ',' << threads << ','
+                                << times.front() << ',' << median << ',' << percentile(times, 0.99) << ','
+                                << (double(width) * height / 1e6) / (median / 1e3) << ','
+                                << sum.c_str() << ',' << status << '\n';
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    golden.save();
+    if (golden.addedCount() > 0 && !allowNew)
+        qWarning("%d new checksums appended to %s, review them or pass --allow-new", golden.addedCount(), options["golden"].c_str());
+    return exact ? 0 : 1;
+}
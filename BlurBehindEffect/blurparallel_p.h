@@ -0,0 +1,68 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <QThreadPool>
+#include <QSemaphore>
+
+//
+// Fork-join helper for the blur kernels without a dedicated BlurPlan.
+// Chunks run on the global thread pool, so no threads are created per call.
+// Chunks no pool thread has started by the time the calling thread finished
+// its own are taken back and run by the calling thread, so a call from a
+// task of a busy pool, e.g. a QtConcurrent one, never waits for a free thread.
+//
+
+/// Runs _job(begin, end) over [0, _count) split into at most _threadCount
+/// chunks, the first chunk is processed by the calling thread
+inline void parallelFor(int _count, int _threadCount, const std::function<void(int, int)>& _job)
+{
+    const int chunks = std::clamp(_threadCount, 1, std::max(_count, 1));
+    if (chunks <= 1)
+    {
+        _job(0, _count);
+        return;
+    }
+
+    class ChunkTask : public QRunnable
+    {
+    public:
+        ChunkTask(const std::function<void(int, int)>& _job, int _begin, int _end, QSemaphore& _done)
+            : job_(_job), begin_(_begin), end_(_end), done_(_done)
+        {
+        }
+
+        void run() override
+        {
+            job_(begin_, end_);
+            done_.release();
+        }
+
+    private:
+        const std::function<void(int, int)>& job_;
+        int begin_;
+        int end_;
+        QSemaphore& done_;
+    };
+
+    // owned here, the pool does not touch a task once it has run
+    QThreadPool* const pool = QThreadPool::globalInstance();
+    QSemaphore done;
+    std::vector<std::unique_ptr<ChunkTask>> tasks;
+    tasks.reserve(chunks - 1);
+    for (int i = 1; i < chunks; ++i)
+    {
+        tasks.push_back(std::make_unique<ChunkTask>(_job, i * _count / chunks, (i + 1) * _count / chunks, done));
+        tasks.back()->setAutoDelete(false);
+        pool->start(tasks.back().get());
+    }
+
+    _job(0, _count / chunks);
+    for (auto it = tasks.rbegin(); it != tasks.rend(); ++it)
+    {
+        if (pool->tryTake(it->get()))
+            (*it)->run();
+    }
+    done.acquire(chunks - 1);
+}
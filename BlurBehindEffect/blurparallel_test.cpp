@@ -0,0 +1,84 @@
+#include "blur.h"
+#include "blurtest_p.h"
+
+#include <cstdlib>
+#include <memory>
+#include <QSemaphore>
+#include <QThreadPool>
+
+//
+// Saturated thread pool test.
+//
+// The multithreaded blurs are called from tasks of the global thread pool
+// while every pool thread runs such a task, so no thread is left for the
+// chunks they queue. They must finish anyway, with the output of the single
+// threaded blur. Returns non-zero on the first mismatch or when the blurs
+// do not finish in time.
+//
+
+namespace
+{
+    /// Threads every blur is asked for, more than a pool of one thread has
+    constexpr int blurThreadCount() noexcept { return 4; }
+
+    class BlurTask : public QRunnable
+    {
+    public:
+        BlurTask(const QImage& _image, QSemaphore& _running, QSemaphore& _go, QSemaphore& _finished, bool& _same)
+            : image_(_image), running_(_running), go_(_go), finished_(_finished), same_(_same)
+        {
+        }
+
+        void run() override
+        {
+            // holds its pool thread until every pool thread runs a task
+            running_.release();
+            go_.acquire();
+
+            same_ = sameImage(stackBlurImage(image_, 8, blurThreadCount()), stackBlurImage(image_, 8))
+                && sameImage(slidingBoxBlurImage(image_, 8, 3, blurThreadCount()), slidingBoxBlurImage(image_, 8))
+                && sameImage(kawaseBlurImage(image_, 2, 3, blurThreadCount()), kawaseBlurImage(image_, 2, 3));
+            finished_.release();
+        }
+
+    private:
+        QImage image_;
+        QSemaphore& running_;
+        QSemaphore& go_;
+        QSemaphore& finished_;
+        bool& same_;
+    };
+}
+
+int main()
+{
+    QThreadPool* const pool = QThreadPool::globalInstance();
+    const int tasks = pool->maxThreadCount();
+    const QImage image = randomImage(320, 240, 1);
+
+    QSemaphore running;
+    QSemaphore go;
+    QSemaphore finished;
+    const std::unique_ptr<bool[]> same(new bool[std::size_t(tasks)]());
+    for (int i = 0; i < tasks; ++i)
+        pool->start(new BlurTask(image, running, go, finished, same[i]));
+
+    running.acquire(tasks);
+    go.release(tasks);
+    if (!finished.tryAcquire(tasks, 60000))
+    {
+        // the blocked pool threads would block the exit as well
+        qWarning("blurs called from a saturated thread pool did not finish");
+        std::_Exit(1);
+    }
+
+    for (int i = 0; i < tasks; ++i)
+    {
+        if (!same[i])
+        {
+            qWarning("blur called from a saturated thread pool differs from the single threaded one");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,485 @@
+#include "blur.h"
+#include "stackblur_p.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <condition_variable>
+#include <QThread>
+
+
+namespace
+{
+    /// Minimal amount of pixels worth an additional thread: smaller
+    /// partitions cost more in wake-up and barrier latency than they save
+    constexpr int minPixelsPerThread() noexcept { return 256 * 256; }
+
+    /// Banded passes scale well up to this amount of threads
+    constexpr int maxBandedThreadCount() noexcept { return 4; }
+
+    /// Largest tile side, keeps (tile + 2 * radius)^2 scratch buffer of
+    /// every worker within a few MB even for the largest radius
+    constexpr int maxTileSide() noexcept { return 512; }
+
+    /// Above this radius the halo grows to more than 2.25x of the tile
+    /// area, so the Auto mode blurs in bands instead
+    constexpr int maxTiledRadius() noexcept { return maxTileSide() / 4; }
+
+    /// Tile side keeps the halo overhead about 1.5x of the tile area up to
+    /// radius 64, larger radii pay a larger halo instead of a larger tile
+    int tileSide(int _radius)
+    {
+        const int side = (std::max(256, _radius * 8) + 63) & ~63;
+        return std::min(side, maxTileSide());
+    }
+
+    /// Sense-reversing barrier, passes are short so waiting
+    /// threads spin for a while before yielding the CPU
+    class SpinBarrier
+    {
+    public:
+        explicit SpinBarrier(int _count) : count_(_count) {}
+
+        void arriveAndWait()
+        {
+            const unsigned int phase = phase_.load(std::memory_order_acquire);
+            if (arrived_.fetch_add(1, std::memory_order_acq_rel) == count_ - 1)
+            {
+                arrived_.store(0, std::memory_order_relaxed);
+                phase_.store(phase + 1, std::memory_order_release);
+                return;
+            }
+
+            for (int spin = 0; phase_.load(std::memory_order_acquire) == phase; ++spin)
+                if (spin > 1024)
+                    std::this_thread::yield();
+        }
+
+    private:
+        const int count_;
+        std::atomic<int> arrived_{ 0 };
+        std::atomic<unsigned int> phase_{ 0 };
+    };
+
+    /// Range of tile indices owned by a worker packed as (begin << 32 | end).
+    /// The owner takes tiles from the front, thieves split off the back half.
+    struct alignas(64) TileRange
+    {
+        std::atomic<quint64> range{ 0 };
+
+        static constexpr quint64 pack(quint32 _begin, quint32 _end) { return (quint64(_begin) << 32) | _end; }
+        static constexpr quint32 begin(quint64 _range) { return quint32(_range >> 32); }
+        static constexpr quint32 end(quint64 _range) { return quint32(_range); }
+
+        void reset(quint32 _begin, quint32 _end) { range.store(pack(_begin, _end), std::memory_order_relaxed); }
+
+        bool pop(quint32& _tile)
+        {
+            quint64 r = range.load(std::memory_order_acquire);
+            while (begin(r) < end(r))
+            {
+                if (range.compare_exchange_weak(r, pack(begin(r) + 1, end(r)), std::memory_order_acq_rel))
+                {
+                    _tile = begin(r);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool steal(quint32& _begin, quint32& _end)
+        {
+            quint64 r = range.load(std::memory_order_acquire);
+            while (begin(r) < end(r))
+            {
+                const quint32 middle = begin(r) + (end(r) - begin(r)) / 2;
+                if (range.compare_exchange_weak(r, pack(begin(r), middle), std::memory_order_acq_rel))
+                {
+                    _begin = middle;
+                    _end = end(r);
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+}
+
+
+class BlurPlanPrivate
+{
+public:
+    QSize size_;
+    int radius_;
+    int maxThreadCount_;
+    int threadCount_;
+    BlurPlan::Mode mode_;
+    unsigned int stackSize_;
+    StackBlurJob job_;
+    std::vector<unsigned char> stacks_;
+    std::vector<std::thread> workers_;
+    SpinBarrier barrier_;
+
+    // tiled mode state
+    int tileSide_;
+    int tileColumns_;
+    int tileCount_;
+    std::size_t scratchSize_;
+    std::vector<unsigned char> scratch_;
+    std::vector<unsigned char> snapshot_;
+    std::vector<unsigned char> patch_;
+    std::unique_ptr<TileRange[]> ranges_;
+
+    std::mutex mutex_;
+    std::condition_variable started_;
+    quint64 generation_;
+    bool quit_;
+    const unsigned char* source_;
+    int sourceBpl_;
+    unsigned char* target_;
+    int targetBpl_;
+
+    BlurPlanPrivate(const QSize& _size, int _radius, int _maxThreadCount, BlurPlan::Mode _mode)
+        : size_(_size)
+        , radius_(_radius)
+        , maxThreadCount_(_maxThreadCount)
+        , threadCount_(BlurPlan::suitableThreadCount(_size, _maxThreadCount))
+        , mode_(_mode)
+        , stackSize_(stackblurStackSize(std::clamp<unsigned int>(_radius, minRadius(), maxRadius())))
+        , job_(stackblurKernelJob(stackblurBestKernel()))
+        , stacks_(stackSize_ * threadCount_)
+        , barrier_(threadCount_)
+        , tileSide_(tileSide(_radius))
+        , tileColumns_(std::max((_size.width() + tileSide_ - 1) / tileSide_, 1))
+        , tileCount_(tileColumns_ * std::max((_size.height() + tileSide_ - 1) / tileSide_, 1))
+        , scratchSize_(0)
+        , generation_(0)
+        , quit_(false)
+        , source_(nullptr)
+        , sourceBpl_(0)
+        , target_(nullptr)
+        , targetBpl_(0)
+    {
+        if (mode_ == BlurPlan::Mode::Auto)
+        {
+            const bool worthTiling = threadCount_ > maxBandedThreadCount() && tileCount_ >= threadCount_ * 2
+                                     && _radius <= maxTiledRadius();
+            mode_ = worthTiling ? BlurPlan::Mode::Tiled : BlurPlan::Mode::Banded;
+        }
+
+        if (mode_ == BlurPlan::Mode::Tiled)
+        {
+            const int side = tileSide_ + 2 * _radius;
+            scratchSize_ = std::size_t(std::min(side, _size.width())) * std::min(side, _size.height()) * 4;
+            scratch_.resize(scratchSize_ * threadCount_);
+            ranges_ = std::make_unique<TileRange[]>(threadCount_);
+        }
+
+        // calling thread always works as the first one
+        workers_.reserve(threadCount_ - 1);
+        for (int core = 1; core < threadCount_; ++core)
+            workers_.emplace_back([this, core]() { workerLoop(core); });
+    }
+
+    bool accepts(const QSize& _size, int _depth) const
+    {
+        if (_size != size_ || _depth != 32 || !job_)
+            return false;
+        return radius_ <= int(maxRadius()) && radius_ >= int(minRadius());
+    }
+
+    ~BlurPlanPrivate()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        started_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+    }
+
+    /// Blurs _area of the source in _scratch and writes its _rect part to the
+    /// target. Pixels of _rect depend on the source within _area only, as
+    /// long as _area is _rect grown by the radius (clipped to the image).
+    void blurArea(const QRect& _rect, const QRect& _area, unsigned char* _scratch, unsigned char* _stack)
+    {
+        const int areaBpl = _area.width() * 4;
+
+        for (int y = 0; y < _area.height(); ++y)
+            std::memcpy(_scratch + y * areaBpl, source_ + (_area.y() + y) * sourceBpl_ + _area.x() * 4, areaBpl);
+
+        job_(_scratch, _area.width(), _area.height(), areaBpl, radius_, 1, 0, 1, _stack);
+        job_(_scratch, _area.width(), _area.height(), areaBpl, radius_, 1, 0, 2, _stack);
+
+        const unsigned char* rectBits = _scratch + (_rect.y() - _area.y()) * areaBpl + (_rect.x() - _area.x()) * 4;
+        for (int y = 0; y < _rect.height(); ++y)
+            std::memcpy(target_ + (_rect.y() + y) * targetBpl_ + _rect.x() * 4, rectBits + y * areaBpl, _rect.width() * 4);
+    }
+
+    /// Blurs tile with its halo in the worker scratch buffer and writes
+    /// the tile itself to the target, so tiles never wait for each other
+    void blurTile(int _tile, int _core)
+    {
+        const QRect bounds{ {}, size_ };
+        const QRect tile = QRect((_tile % tileColumns_) * tileSide_, (_tile / tileColumns_) * tileSide_, tileSide_, tileSide_) & bounds;
+        const QRect area = tile.adjusted(-radius_, -radius_, radius_, radius_) & bounds;
+
+        blurArea(tile, area, scratch_.data() + scratchSize_ * _core, stacks_.data() + stackSize_ * _core);
+    }
+
+    /// Recomputes the blurred pixels affected by _dirty source pixels in the
+    /// calling thread, the workers are idle between the executions
+    void executePatch(const QRect& _affected, const QRect& _area,
+                      const unsigned char* _source, int _sourceBpl, unsigned char* _target, int _targetBpl)
+    {
+        source_ = _source;
+        sourceBpl_ = _sourceBpl;
+        target_ = _target;
+        targetBpl_ = _targetBpl;
+
+        patch_.resize(std::size_t(_area.width()) * 4 * _area.height());
+        blurArea(_affected, _area, patch_.data(), stacks_.data());
+    }
+
+    void runTiles(int _core)
+    {
+        quint32 tile = 0;
+        while (ranges_[_core].pop(tile))
+            blurTile(tile, _core);
+
+        // own tiles are over, help the others
+        for (int i = 1; i < threadCount_; ++i)
+        {
+            TileRange& victim = ranges_[(_core + i) % threadCount_];
+            quint32 begin = 0, end = 0;
+            while (victim.steal(begin, end))
+            {
+                ranges_[_core].reset(begin + 1, end);
+                blurTile(begin, _core);
+                while (ranges_[_core].pop(tile))
+                    blurTile(tile, _core);
+            }
+        }
+    }
+
+    void run(int _core)
+    {
+        unsigned char* stack = stacks_.data() + stackSize_ * _core;
+        if (mode_ == BlurPlan::Mode::Tiled)
+        {
+            runTiles(_core);
+        }
+        else
+        {
+            job_(target_, size_.width(), size_.height(), targetBpl_, radius_, threadCount_, _core, 1, stack);
+            barrier_.arriveAndWait();
+            job_(target_, size_.width(), size_.height(), targetBpl_, radius_, threadCount_, _core, 2, stack);
+        }
+        // completion, every worker leaves the run before the next one starts
+        barrier_.arriveAndWait();
+    }
+
+    void workerLoop(int _core)
+    {
+        quint64 seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                started_.wait(lock, [&]() { return quit_ || generation_ != seen; });
+                if (quit_)
+                    return;
+                seen = generation_;
+            }
+            run(_core);
+        }
+    }
+
+    void execute(const unsigned char* _source, int _sourceBpl, unsigned char* _target, int _targetBpl)
+    {
+        const int w = size_.width();
+        if (mode_ == BlurPlan::Mode::Banded && _source != _target)
+        {
+            for (int y = 0; y < size_.height(); ++y)
+                std::memcpy(_target + y * _targetBpl, _source + y * _sourceBpl, w * 4);
+        }
+
+        if (threadCount_ <= 1 && mode_ == BlurPlan::Mode::Banded)
+        {
+            job_(_target, w, size_.height(), _targetBpl, radius_, 1, 0, 1, stacks_.data());
+            job_(_target, w, size_.height(), _targetBpl, radius_, 1, 0, 2, stacks_.data());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            source_ = _source;
+            sourceBpl_ = _sourceBpl;
+            target_ = _target;
+            targetBpl_ = _targetBpl;
+            if (mode_ == BlurPlan::Mode::Tiled)
+            {
+                // contiguous runs of tiles keep neighbour tiles on the same core
+                for (int core = 0; core < threadCount_; ++core)
+                    ranges_[core].reset(core * tileCount_ / threadCount_, (core + 1) * tileCount_ / threadCount_);
+            }
+            ++generation_;
+        }
+        started_.notify_all();
+        run(0);
+    }
+};
+
+
+BlurPlan::BlurPlan(const QSize& _size, int _radius, int _maxThreadCount, Mode _mode)
+    : d(std::make_unique<BlurPlanPrivate>(_size, _radius, _maxThreadCount, _mode))
+{
+}
+
+BlurPlan::~BlurPlan() = default;
+
+QSize BlurPlan::size() const
+{
+    return d->size_;
+}
+
+int BlurPlan::radius() const
+{
+    return d->radius_;
+}
+
+int BlurPlan::maxThreadCount() const
+{
+    return d->maxThreadCount_;
+}
+
+int BlurPlan::threadCount() const
+{
+    return d->threadCount_;
+}
+
+BlurPlan::Mode BlurPlan::mode() const
+{
+    return d->mode_;
+}
+
+bool BlurPlan::matches(const QSize& _size, int _radius, int _maxThreadCount) const
+{
+    return d->size_ == _size && d->radius_ == _radius && d->maxThreadCount_ == _maxThreadCount;
+}
+
+bool BlurPlan::isExecutable(const QImage& _image) const
+{
+    return d->accepts(_image.size(), _image.depth());
+}
+
+bool BlurPlan::isExecutable(const BlurImageRef& _image) const
+{
+    return !_image.isNull() && d->accepts(QSize(_image.width, _image.height), _image.depth());
+}
+
+void BlurPlan::execute(QImage& _image)
+{
+    if (isExecutable(_image))
+        execute(BlurImageRef(_image));
+}
+
+void BlurPlan::execute(const BlurImageRef& _image)
+{
+    if (!isExecutable(_image))
+        return;
+
+    if (d->mode_ == Mode::Tiled)
+    {
+        // tiles read halos of their neighbours, so they need an intact source
+        const int bpl = d->size_.width() * 4;
+        d->snapshot_.resize(std::size_t(bpl) * d->size_.height());
+        for (int y = 0; y < d->size_.height(); ++y)
+            std::memcpy(d->snapshot_.data() + y * bpl, _image.scanLine(y), bpl);
+        d->execute(d->snapshot_.data(), bpl, _image.bits, _image.bytesPerLine);
+        return;
+    }
+
+    d->execute(_image.bits, _image.bytesPerLine, _image.bits, _image.bytesPerLine);
+}
+
+void BlurPlan::execute(const QImage& _source, QImage& _target)
+{
+    if (!isExecutable(_source))
+        return;
+
+    if (_target.size() != _source.size() || _target.format() != _source.format())
+        _target = QImage(_source.size(), _source.format());
+
+    d->execute(_source.constBits(), _source.bytesPerLine(), _target.bits(), _target.bytesPerLine());
+}
+
+void BlurPlan::execute(const BlurImageRef& _source, const BlurImageRef& _target)
+{
+    if (!isExecutable(_source) || !isExecutable(_target))
+        return;
+
+    if (_source.bits == _target.bits)
+        return execute(_target);
+
+    d->execute(_source.bits, _source.bytesPerLine, _target.bits, _target.bytesPerLine);
+}
+
+int BlurPlan::suitableThreadCount(const QSize& _size, int _maxThreadCount)
+{
+    const int maxCores = std::max(QThread::idealThreadCount(), 1);
+    const int cores = std::clamp(_maxThreadCount == -1 ? maxCores : _maxThreadCount, 1, maxCores);
+    const qint64 pixels = qint64(std::max(_size.width(), 0)) * std::max(_size.height(), 0);
+    return int(std::clamp<qint64>(pixels / minPixelsPerThread(), 1, cores));
+}
+
+void BlurPlan::execute(const BlurImageRef& _source, const BlurImageRef& _target, const QRegion& _dirty)
+{
+    if (!isExecutable(_source) || !isExecutable(_target) || _source.bits == _target.bits)
+        return;
+
+    // blurred pixels within the radius of the dirty ones change, and they
+    // depend on the source within the radius around themselves. Overlapping
+    // patches are merged, so no blurred pixel is computed twice
+    const QRect bounds{ {}, d->size_ };
+    const int r = d->radius_;
+    std::vector<QRect> patches;
+    for (const QRect& rect : _dirty)
+    {
+        QRect affected = rect.adjusted(-r, -r, r, r) & bounds;
+        if (affected.isEmpty())
+            continue;
+
+        for (std::size_t i = 0; i < patches.size();)
+        {
+            if (patches[i].intersects(affected))
+            {
+                affected |= patches[i];
+                patches.erase(patches.begin() + i);
+                i = 0;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        patches.push_back(affected);
+    }
+    if (patches.empty())
+        return;
+
+    qint64 pixels = 0;
+    for (const QRect& affected : patches)
+    {
+        const QRect area = affected.adjusted(-r, -r, r, r) & bounds;
+        pixels += qint64(area.width()) * area.height();
+    }
+    if (pixels > qint64(bounds.width()) * bounds.height() / 2)
+        return execute(_source, _target);
+
+    for (const QRect& affected : patches)
+        d->executePatch(affected, affected.adjusted(-r, -r, r, r) & bounds, _source.bits, _source.bytesPerLine, _target.bits, _target.bytesPerLine);
+}
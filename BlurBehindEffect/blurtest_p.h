@@ -0,0 +1,48 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <QImage>
+
+//
+// Image helpers shared by the blur tests and the benchmark.
+//
+
+/// Premultiplied image of random pixels, the same for the same _seed
+inline QImage randomImage(int _width, int _height, unsigned int _seed)
+{
+    std::mt19937 random(_seed);
+    QImage image(_width, _height, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < _height; ++y)
+    {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < _width; ++x)
+        {
+            const int alpha = int(random() & 0xff);
+            line[x] = qRgba(int(random() % (alpha + 1)), int(random() % (alpha + 1)), int(random() % (alpha + 1)), alpha);
+        }
+    }
+    return image;
+}
+
+/// Largest difference of a channel between 32-bit images of the same size
+inline int maxDifference(const QImage& _a, const QImage& _b)
+{
+    if (_a.size() != _b.size() || _a.depth() != 32 || _b.depth() != 32)
+        return 255;
+
+    int difference = 0;
+    for (int y = 0; y < _a.height(); ++y)
+    {
+        const uchar* a = _a.constScanLine(y);
+        const uchar* b = _b.constScanLine(y);
+        for (int i = 0; i < _a.width() * 4; ++i)
+            difference = std::max(difference, std::abs(a[i] - b[i]));
+    }
+    return difference;
+}
+
+inline bool sameImage(const QImage& _a, const QImage& _b)
+{
+    return maxDifference(_a, _b) == 0;
+}
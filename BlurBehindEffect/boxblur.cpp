@@ -1,25 +1,34 @@
 #include "blur.h"
+#include "blurparallel_p.h"
 
-QImage boxBlurImage(const QImage& _image, const QRect& _rect, int _radius)
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+bool boxBlur(const BlurImageRef& _image, int _radius)
 {
+    if (_image.isNull() || (_image.depth() != 32 && !_image.isSingleChannel()))
+        return false;
+
     static Q_CONSTEXPR int tab[] = { 14, 10, 8, 6, 5, 5, 4, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2 };
     const int alpha = (_radius < 1)  ? 16 : (_radius > 17) ? 1 : tab[_radius-1];
 
-    QImage result = _image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
-    const int r1 = _rect.top();
-    const int r2 = _rect.bottom();
-    const int c1 = _rect.left();
-    const int c2 = _rect.right();
+    const int r1 = 0;
+    const int r2 = _image.height - 1;
+    const int c1 = 0;
+    const int c2 = _image.width - 1;
 
-    const int bpl = result.bytesPerLine();
+    const int bpl = _image.bytesPerLine;
     int rgba[4];
     unsigned char* p;
 
+    const int bpp = _image.depth() / 8;
     int i1 = 0;
-    int i2 = 3;
+    int i2 = bpp - 1;
 
     for (int col = c1; col <= c2; col++) {
-        p = result.scanLine(r1) + col * 4;
+        p = _image.scanLine(r1) + col * bpp;
         for (int i = i1; i <= i2; i++)
             rgba[i] = p[i] << 4;
 
@@ -30,18 +39,18 @@ QImage boxBlurImage(const QImage& _image, const QRect& _rect, int _radius)
     }
 
     for (int row = r1; row <= r2; row++) {
-        p = result.scanLine(row) + c1 * 4;
+        p = _image.scanLine(row) + c1 * bpp;
         for (int i = i1; i <= i2; i++)
             rgba[i] = p[i] << 4;
 
-        p += 4;
-        for (int j = c1; j < c2; j++, p += 4)
+        p += bpp;
+        for (int j = c1; j < c2; j++, p += bpp)
             for (int i = i1; i <= i2; i++)
                 p[i] = static_cast<unsigned char>((rgba[i] += ((p[i] << 4) - rgba[i]) * alpha / 16) >> 4);
     }
 
     for (int col = c1; col <= c2; col++) {
-        p = result.scanLine(r2) + col * 4;
+        p = _image.scanLine(r2) + col * bpp;
         for (int i = i1; i <= i2; i++)
             rgba[i] = p[i] << 4;
 
@@ -52,16 +61,200 @@ QImage boxBlurImage(const QImage& _image, const QRect& _rect, int _radius)
     }
 
     for (int row = r1; row <= r2; row++) {
-        p = result.scanLine(row) + c2 * 4;
+        p = _image.scanLine(row) + c2 * bpp;
         for (int i = i1; i <= i2; i++)
             rgba[i] = p[i] << 4;
 
-        p -= 4;
-        for (int j = c1; j < c2; j++, p -= 4)
+        p -= bpp;
+        for (int j = c1; j < c2; j++, p -= bpp)
             for (int i = i1; i <= i2; i++)
                 p[i] = static_cast<unsigned char>((rgba[i] += ((p[i] << 4) - rgba[i]) * alpha / 16) >> 4);
     }
 
+    return true;
+}
+
+namespace
+{
+    /// Single channel images are blurred as they are, everything else as premultiplied ARGB32
+    QImage blurInput(const QImage& _image)
+    {
+        if (_image.format() == QImage::Format_Alpha8 || _image.format() == QImage::Format_Grayscale8)
+            return _image;
+        return _image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+}
+
+QImage boxBlurImage(const QImage& _image, const QRect& _rect, int _radius)
+{
+    QImage result = blurInput(_image);
+    boxBlur(BlurImageRef(result).subRect(_rect), _radius);
     return result;
 }
 
+
+
+namespace
+{
+    /// Radii of _passes successive box blurs, whose convolution approximates
+    /// gaussian with _sigma (see "Fast Almost-Gaussian Filtering", Kovesi)
+    std::vector<int> gaussianBoxRadii(double _sigma, int _passes)
+    {
+        const double variance = 12.0 * _sigma * _sigma;
+        int lower = int(std::floor(std::sqrt(variance / _passes + 1.0)));
+        if (lower % 2 == 0)
+            --lower;
+        const int upper = lower + 2;
+        const int lowerPasses = qRound((variance - _passes * lower * lower - 4 * _passes * lower - 3 * _passes) / (-4.0 * lower - 4.0));
+
+        std::vector<int> radii(_passes);
+        for (int i = 0; i < _passes; ++i)
+            radii[i] = ((i < lowerPasses ? lower : upper) - 1) / 2;
+        return radii;
+    }
+
+    /// Fixed point reciprocal of the box size, sum / div == (sum * mul + 2^31) >> 32
+    inline quint64 boxMultiplier(int _radius)
+    {
+        const quint64 div = 2 * _radius + 1;
+        return ((Q_UINT64_C(1) << 32) + div / 2) / div;
+    }
+
+    inline uchar boxAverage(quint32 _sum, quint64 _mul)
+    {
+        return uchar((_sum * _mul + (Q_UINT64_C(1) << 31)) >> 32);
+    }
+
+    /// Horizontal sliding box of (2 * _radius + 1) pixels over a single row,
+    /// edge pixels are repeated, so the cost does not depend on the radius
+    template<int Channels>
+    void boxBlurRow(const uchar* _src, uchar* _dst, int _w, int _radius, quint64 _mul)
+    {
+        const int wm = _w - 1;
+
+        quint32 sum[Channels];
+        const int inner = std::min(_radius, wm);
+        for (int c = 0; c < Channels; ++c)
+        {
+            sum[c] = _src[c] * (_radius + 1) + _src[wm * Channels + c] * (_radius - inner);
+            for (int i = 1; i <= inner; ++i)
+                sum[c] += _src[i * Channels + c];
+        }
+
+        // clamped indices are only needed near the edges
+        const int x1 = std::clamp(wm - _radius, 0, _w);
+        const int x2 = std::clamp(_radius, x1, _w);
+        auto slide = [&](int _x, const uchar* _in, const uchar* _out) {
+            for (int c = 0; c < Channels; ++c)
+            {
+                _dst[_x * Channels + c] = boxAverage(sum[c], _mul);
+                sum[c] += _in[c];
+                sum[c] -= _out[c];
+            }
+        };
+
+        int x = 0;
+        for (; x < std::min(x1, _radius); ++x)
+            slide(x, _src + (x + _radius + 1) * Channels, _src);
+        for (; x < x1; ++x)
+            slide(x, _src + (x + _radius + 1) * Channels, _src + (x - _radius) * Channels);
+        for (; x < x2; ++x)
+            slide(x, _src + wm * Channels, _src);
+        for (; x < _w; ++x)
+            slide(x, _src + wm * Channels, _src + (x - _radius) * Channels);
+    }
+
+    /// Width of the vertical strip (in bytes) copied aside by the in place
+    /// vertical pass, strip of a full HD image still fits into L2 cache
+    constexpr int boxStripBytes() noexcept { return 128; }
+
+    /// Vertical sliding box over _n bytes of every row. Column sums
+    /// are kept for the whole strip, so rows are read sequentially
+    void boxBlurColumns(const uchar* _src, int _srcBpl, uchar* _dst, int _dstBpl, int _h, int _n, int _radius, quint64 _mul)
+    {
+        const int hm = _h - 1;
+        const int inner = std::min(_radius, hm);
+
+        quint32 sums[boxStripBytes()];
+        const uchar* first = _src;
+        const uchar* last = _src + hm * _srcBpl;
+        for (int i = 0; i < _n; ++i)
+            sums[i] = first[i] * (_radius + 1) + last[i] * (_radius - inner);
+        for (int y = 1; y <= inner; ++y)
+        {
+            const uchar* row = _src + y * _srcBpl;
+            for (int i = 0; i < _n; ++i)
+                sums[i] += row[i];
+        }
+
+        for (int y = 0; y < _h; ++y)
+        {
+            uchar* dst = _dst + y * _dstBpl;
+            const uchar* in = _src + std::min(y + _radius + 1, hm) * _srcBpl;
+            const uchar* out = _src + std::max(y - _radius, 0) * _srcBpl;
+            for (int i = 0; i < _n; ++i)
+            {
+                dst[i] = boxAverage(sums[i], _mul);
+                sums[i] += in[i];
+                sums[i] -= out[i];
+            }
+        }
+    }
+}
+
+bool slidingBoxBlur(const BlurImageRef& _image, int _radius, int _passes, int _threadCount)
+{
+    if (_image.isNull() || (_image.depth() != 32 && !_image.isSingleChannel()))
+        return false;
+    if (_radius < 1)
+        return true;
+
+    // match variance of the stackblur triangle kernel of the same radius
+    const double sigma = std::sqrt(_radius * (_radius + 2) / 6.0);
+    const std::vector<int> radii = gaussianBoxRadii(sigma, std::clamp(_passes, 1, 5));
+
+    const int w = _image.width;
+    const int h = _image.height;
+    const int rowBytes = w * _image.depth() / 8;
+    const auto blurRow = _image.isSingleChannel() ? &boxBlurRow<1> : &boxBlurRow<4>;
+    const int strips = (rowBytes + boxStripBytes() - 1) / boxStripBytes();
+
+    // every pass reads a private copy of the row or strip being written,
+    // so the caller buffer is blurred in place with O(row + strip) memory
+    for (int radius : radii)
+    {
+        if (radius < 1)
+            continue;
+
+        const quint64 mul = boxMultiplier(radius);
+        parallelFor(h, _threadCount, [&](int _begin, int _end) {
+            std::vector<uchar> line(rowBytes);
+            for (int y = _begin; y < _end; ++y)
+            {
+                uchar* row = _image.scanLine(y);
+                std::memcpy(line.data(), row, rowBytes);
+                blurRow(line.data(), row, w, radius, mul);
+            }
+        });
+        parallelFor(strips, _threadCount, [&](int _begin, int _end) {
+            std::vector<uchar> strip(std::size_t(boxStripBytes()) * h);
+            for (int s = _begin; s < _end; ++s)
+            {
+                const int x = s * boxStripBytes();
+                const int n = std::min(boxStripBytes(), rowBytes - x);
+                for (int y = 0; y < h; ++y)
+                    std::memcpy(strip.data() + y * n, _image.scanLine(y) + x, n);
+                boxBlurColumns(strip.data(), n, _image.bits + x, _image.bytesPerLine, h, n, radius, mul);
+            }
+        });
+    }
+
+    return true;
+}
+
+QImage slidingBoxBlurImage(const QImage& _image, int _radius, int _passes, int _threadCount)
+{
+    QImage result = blurInput(_image);
+    slidingBoxBlur(BlurImageRef(result), _radius, _passes, _threadCount);
+    return result;
+}
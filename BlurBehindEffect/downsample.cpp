@@ -0,0 +1,139 @@
+#include "blur.h"
+#include "blurparallel_p.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DOWNSAMPLE_SSE2
+#include <emmintrin.h>
+#endif
+
+//
+// Area averaging resampler used to shrink the grabbed background before blurring.
+//
+// Every target pixel is the coverage weighted mean of the source pixels under
+// it, like QImage::scaled() with Qt::SmoothTransformation does, but the source
+// is read in place from any sub rect and the result goes to a caller buffer.
+//
+
+namespace
+{
+    /// Weights of a single axis sum up to 1 << areaWeightBits()
+    constexpr int areaWeightBits() noexcept { return 14; }
+
+    /// Vertical sums keep this many fractional bits, so they fit signed
+    /// 16 bits and the horizontal accumulation still fits 32 bits
+    constexpr int areaColumnBits() noexcept { return 7; }
+
+    /// Source pixels covered by every target pixel of one axis with fixed point coverage
+    class AreaWeights
+    {
+    public:
+        AreaWeights(int _sourceSize, int _targetSize)
+            : first_(_targetSize)
+            , offsets_(_targetSize + 1)
+        {
+            const double scale = double(_sourceSize) / _targetSize;
+            for (int i = 0; i < _targetSize; ++i)
+            {
+                const double begin = i * scale;
+                const double end = std::min((i + 1) * scale, double(_sourceSize));
+                const int first = std::min(int(begin), _sourceSize - 1);
+                const int last = std::clamp(int(std::ceil(end)) - 1, first, _sourceSize - 1);
+
+                // rounding of the cumulative coverage keeps the sum exact
+                first_[i] = first;
+                offsets_[i] = int(weights_.size());
+                int previous = 0;
+                for (int j = first; j <= last; ++j)
+                {
+                    const double covered = (std::min(end, j + 1.0) - begin) / (end - begin);
+                    const int cumulative = j == last ? (1 << areaWeightBits()) : int(std::lround(covered * (1 << areaWeightBits())));
+                    weights_.push_back(quint32(cumulative - previous));
+                    previous = cumulative;
+                }
+            }
+            offsets_[_targetSize] = int(weights_.size());
+        }
+
+        int first(int _i) const { return first_[_i]; }
+        int count(int _i) const { return offsets_[_i + 1] - offsets_[_i]; }
+        const quint32* weights(int _i) const { return weights_.data() + offsets_[_i]; }
+
+    private:
+        std::vector<int> first_;
+        std::vector<int> offsets_;
+        std::vector<quint32> weights_;
+    };
+
+    /// Weighted sum of _count pixels of vertical sums at _p, written as a 32-bit pixel to _dst
+    inline void areaPixel(const quint32* _p, const quint32* _weights, int _count, uchar* _dst)
+    {
+        constexpr int shift = areaWeightBits() + areaColumnBits();
+#if defined(DOWNSAMPLE_SSE2)
+        // values and weights fit 16 bits, so madd multiplies all channels at once
+        __m128i sum = _mm_set1_epi32(1 << (shift - 1));
+        for (int i = 0; i < _count; ++i, _p += 4)
+        {
+            const __m128i v = _mm_srli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(_p)), areaWeightBits() - areaColumnBits());
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_set1_epi32(int(_weights[i]))));
+        }
+        sum = _mm_srli_epi32(sum, shift);
+        sum = _mm_packs_epi32(sum, sum);
+        const int pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+        std::memcpy(_dst, &pixel, sizeof(pixel));
+#else
+        quint32 sum[4] = {};
+        for (int i = 0; i < _count; ++i, _p += 4)
+            for (int c = 0; c < 4; ++c)
+                sum[c] += (_p[c] >> (areaWeightBits() - areaColumnBits())) * _weights[i];
+        for (int c = 0; c < 4; ++c)
+            _dst[c] = uchar((sum[c] + (1u << (shift - 1))) >> shift);
+#endif
+    }
+}
+
+bool downsample(const BlurImageRef& _source, const BlurImageRef& _target, int _threadCount)
+{
+    if (_source.isNull() || _target.isNull() || _source.depth() != 32 || _target.depth() != 32)
+        return false;
+
+    const AreaWeights columns(_source.width, _target.width);
+    const AreaWeights rows(_source.height, _target.height);
+
+    // rows are blended first, it is a plain loop over the covered source
+    // bytes, then every target pixel sums a few neighbours of the blend
+    const int sourceBytes = _source.width * 4;
+    parallelFor(_target.height, _threadCount, [&](int _begin, int _end) {
+        std::vector<quint32> blended(sourceBytes);
+        for (int y = _begin; y < _end; ++y)
+        {
+            const quint32* wy = rows.weights(y);
+            for (int j = 0; j < rows.count(y); ++j)
+            {
+                const uchar* src = _source.scanLine(rows.first(y) + j);
+                const quint32 w = wy[j];
+                quint32* sum = blended.data();
+                if (j == 0)
+                {
+                    for (int i = 0; i < sourceBytes; ++i)
+                        sum[i] = src[i] * w;
+                }
+                else
+                {
+                    for (int i = 0; i < sourceBytes; ++i)
+                        sum[i] += src[i] * w;
+                }
+            }
+
+            uchar* dst = _target.scanLine(y);
+            for (int x = 0; x < _target.width; ++x, dst += 4)
+                areaPixel(blended.data() + columns.first(x) * 4, columns.weights(x), columns.count(x), dst);
+        }
+    });
+
+    return true;
+}
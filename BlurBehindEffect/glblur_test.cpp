@@ -0,0 +1,160 @@
+#include "blur.h"
+#include "glblurfunctions.h"
+#include "blurtest_p.h"
+
+#include <cstring>
+#include <memory>
+#include <QGuiApplication>
+
+//
+// GL blur test.
+//
+// The context is created with the requested OpenGL 3.3 core format, the
+// dual Kawase output stays within one rounding step per pass of its CPU
+// port, queued blurs of alternating sizes match the synchronous ones and
+// every entry point makes its own context current, the destructor included,
+// which makes the previously current context current again.
+//
+// With --expect-invalid, e.g. on the "minimal" platform that has no OpenGL,
+// the functions must report themselves invalid and every entry point must
+// fail without touching its result. Without a context otherwise the test is
+// skipped with exit code 77. Returns non-zero on the first failure.
+//
+
+namespace
+{
+    int testInvalid(GLBlurFunctions& _gl)
+    {
+        if (_gl.isValid())
+        {
+            qWarning("functions are valid without OpenGL");
+            return 1;
+        }
+
+        const QImage image = randomImage(64, 48, 1);
+        QImage result = image;
+        if (_gl.blurImage_DualKawase(image, 2, 2, result) || !sameImage(result, image)
+            || _gl.queueBlur_DualKawase(image, 2, 2) || _gl.finishedBlurCount() != 0
+            || _gl.takeBlurResult(&result, true) || !sameImage(result, image) || _gl.pendingBlurCount() != 0)
+        {
+            qWarning("invalid functions blurred or queued");
+            return 1;
+        }
+        _gl.discardBlurResults();
+        return 0;
+    }
+
+    int testValid(std::unique_ptr<GLBlurFunctions>& _gl)
+    {
+        // the format is set before the context is created, so it is honoured
+        const QOpenGLContext* context = QOpenGLContext::currentContext();
+        const QSurfaceFormat format = context ? context->format() : QSurfaceFormat();
+        if (format.version() < qMakePair(3, 3) || format.profile() != QSurfaceFormat::CoreProfile)
+        {
+            qWarning("context is OpenGL %d.%d, not 3.3 core", format.majorVersion(), format.minorVersion());
+            return 1;
+        }
+
+        const QSize sizes[] = { QSize(64, 64), QSize(333, 211), QSize(640, 480) };
+        int largest = 0;
+        for (const QSize& size : sizes)
+        {
+            const QImage image = randomImage(size.width(), size.height(), uint(size.width()));
+            for (int iterations = 1; iterations <= 5; ++iterations)
+            {
+                QImage result;
+                if (!_gl->blurImage_DualKawase(image, 2, iterations, result))
+                {
+                    qWarning("%dx%d iterations %d not blurred", size.width(), size.height(), iterations);
+                    return 1;
+                }
+
+                // every pass may round one step off the CPU port
+                const int difference = maxDifference(result, kawaseBlurImage(image, 2, iterations));
+                if (difference > 2 * iterations)
+                {
+                    qWarning("%dx%d iterations %d differs from the CPU port by %d", size.width(), size.height(), iterations, difference);
+                    return 1;
+                }
+                largest = std::max(largest, difference);
+            }
+        }
+        qWarning("largest difference to the CPU port %d", largest);
+
+        // targets of alternating sizes are kept, queued results are the synchronous ones
+        const QImage a = randomImage(300, 200, 2);
+        const QImage b = randomImage(123, 77, 3);
+        QImage blurredA;
+        QImage blurredB;
+        _gl->blurImage_DualKawase(a, 2, 3, blurredA);
+        _gl->blurImage_DualKawase(b, 2, 3, blurredB);
+        for (int i = 0; i < GLBlurFunctions::ReadbackBufferCount; ++i)
+            _gl->queueBlur_DualKawase(i % 2 ? b : a, 2, 3);
+        for (int i = 0; i < GLBlurFunctions::ReadbackBufferCount; ++i)
+        {
+            QImage result;
+            if (!_gl->takeBlurResult(&result, true) || !sameImage(result, i % 2 ? blurredB : blurredA))
+            {
+                qWarning("queued blur %d differs from the synchronous one", i);
+                return 1;
+            }
+        }
+
+        // another context made current in between, e.g. of a widget
+        QOpenGLContext other;
+        QOffscreenSurface otherSurface;
+        other.setFormat(format);
+        otherSurface.setFormat(format);
+        otherSurface.create();
+        if (!other.create() || !other.makeCurrent(&otherSurface))
+        {
+            qWarning("second context not available");
+            return 1;
+        }
+        QImage result;
+        if (!_gl->queueBlur_DualKawase(a, 2, 3))
+            return 1;
+        other.makeCurrent(&otherSurface);
+        if (!_gl->takeBlurResult(&result, true) || !sameImage(result, blurredA))
+        {
+            qWarning("queued blur differs after another context was current");
+            return 1;
+        }
+        other.makeCurrent(&otherSurface);
+        if (!_gl->blurImage_DualKawase(b, 2, 3, result) || !sameImage(result, blurredB))
+        {
+            qWarning("blur differs after another context was current");
+            return 1;
+        }
+
+        // the destructor deletes its objects in its own context
+        _gl->queueBlur_DualKawase(a, 2, 3);
+        other.makeCurrent(&otherSurface);
+        _gl.reset();
+        if (QOpenGLContext::currentContext() != &other)
+        {
+            qWarning("destructor did not make the previous context current again");
+            return 1;
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const bool expectInvalid = argc > 1 && std::strcmp(argv[1], "--expect-invalid") == 0;
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication application(argc, argv);
+
+    auto gl = std::make_unique<GLBlurFunctions>();
+    if (expectInvalid)
+        return testInvalid(*gl);
+
+    if (!gl->isValid())
+    {
+        qWarning("no OpenGL 3.3 core context, skipped: the offscreen platform needs an X server, e.g. xvfb-run -a");
+        return 77;
+    }
+    return testValid(gl);
+}
@@ -1,5 +1,7 @@
 #include "glblurfunctions.h"
 
+#include <cstring>
+
 static const Vertex sg_vertexes[] =
 {
   Vertex( QVector3D( 1.0f,  1.0f, 1.0f)),
@@ -8,33 +10,74 @@ static const Vertex sg_vertexes[] =
   Vertex( QVector3D( 1.0f, -1.0f, 1.0f))
 };
 
+// Targets of sizes no longer used are deleted above this count, it
+// covers a different size for every blur the readback queue may hold
+static const int sg_maxBlurTargets = GLBlurFunctions::ReadbackBufferCount;
+
+// Longest a waiting take blocks for the GPU, in nanoseconds: a few frames,
+// so a busy or hung GPU stalls the UI briefly instead of indefinitely
+static const GLuint64 sg_readbackWaitTimeout = 50000000;
+
 GLBlurFunctions::GLBlurFunctions()
 {
+    m_ShaderProgram_kawase_up = nullptr;
+    m_ShaderProgram_kawase_down = nullptr;
+    m_Surface = nullptr;
+    m_target = nullptr;
+    m_valid = false;
+
+    // Empty queues make discardBlurResults() safe on invalid functions too
+    for (int i = 0; i < ReadbackBufferCount; i++) {
+        m_readbackFences[i] = nullptr;
+        m_readbackBytes[i] = 0;
+    }
+    m_readbackFirst = 0;
+    m_readbackCount = 0;
+    GPUTimerFirst = 0;
+    GPUTimerCount = 0;
+    GPUtimerElapsedTime = 0;
+    CPUTimerElapsedTime = 0;
+
+    // The blur renders into FBOs only, so the surface is never drawn to and
+    // any offscreen one works: a pbuffer of the window system or, headless,
+    // a surfaceless EGL context such as Mesa llvmpipe provides. The format
+    // has to be set before create() for either of them to honour it
+    QSurfaceFormat surfaceFormat = QSurfaceFormat::defaultFormat();
+    surfaceFormat.setVersion(3, 3);
+    surfaceFormat.setProfile(QSurfaceFormat::CoreProfile);
+
     m_Context = new QOpenGLContext();
-    m_Context->setFormat(QSurfaceFormat::defaultFormat());
-    m_Context->create();
+    m_Context->setFormat(surfaceFormat);
+    if (!m_Context->create()) {
+        qWarning() << "GLBlurFunctions: cannot create an OpenGL context";
+        return;
+    }
 
     m_Surface = new QOffscreenSurface();
+    m_Surface->setFormat(m_Context->format());
     m_Surface->create();
+    if (!m_Surface->isValid() || !m_Context->makeCurrent(m_Surface)) {
+        qWarning() << "GLBlurFunctions: cannot make the OpenGL context current on an offscreen surface";
+        return;
+    }
 
-    QSurfaceFormat surfaceFormat;
-    surfaceFormat.setVersion(3, 3);
-    surfaceFormat.setProfile(QSurfaceFormat::CoreProfile);
-    m_Surface->setFormat(surfaceFormat);
-
-    m_Context->makeCurrent(m_Surface);
-
-    initializeOpenGLFunctions();
+    if (!initializeOpenGLFunctions()) {
+        qWarning() << "GLBlurFunctions: OpenGL 3.3 core is not available, got" << m_Context->format().version();
+        return;
+    }
 
     m_ShaderProgram_kawase_up = new QOpenGLShaderProgram();
     m_ShaderProgram_kawase_up->addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/simple.vert");
     m_ShaderProgram_kawase_up->addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shaders/dual_kawase_up.frag");
-    m_ShaderProgram_kawase_up->link();
 
     m_ShaderProgram_kawase_down = new QOpenGLShaderProgram();
     m_ShaderProgram_kawase_down->addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/simple.vert");
     m_ShaderProgram_kawase_down->addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shaders/dual_kawase_down.frag");
-    m_ShaderProgram_kawase_down->link();
+
+    if (!m_ShaderProgram_kawase_up->link() || !m_ShaderProgram_kawase_down->link()) {
+        qWarning() << "GLBlurFunctions: cannot link the blur shaders";
+        return;
+    }
 
     m_VertexBuffer.create();
     m_VertexBuffer.bind();
@@ -50,43 +93,245 @@ GLBlurFunctions::GLBlurFunctions()
     m_ShaderProgram_kawase_down->enableAttributeArray(0);
     m_ShaderProgram_kawase_down->setAttributeBuffer(0, GL_FLOAT, Vertex::positionOffset(), Vertex::PositionTupleSize, Vertex::stride());
 
-    m_textureToBlur = new QOpenGLTexture(QImage());
-    m_textureToBlur->setWrapMode(QOpenGLTexture::ClampToEdge);
-    m_textureToBlur->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+    glGenQueries(GPUTimerQueryCount, GPUTimerQueries);
 
-    m_iterations = -1;
-    m_imageToBlur = QImage();
+    glGenBuffers(ReadbackBufferCount, m_readbackPBOs);
+
+    m_valid = true;
 }
 
 GLBlurFunctions::~GLBlurFunctions()
 {
+    // GL objects belong to this context, another one may be current by now,
+    // e.g. of a widget painting while the last blurring effect goes away.
+    // That one is current again afterwards
+    QOpenGLContext* previousContext = QOpenGLContext::currentContext();
+    QSurface* previousSurface = previousContext ? previousContext->surface() : nullptr;
+
+    if (makeCurrent()) {
+        for (int i = 0; i < m_targets.size(); i++) {
+            deleteTarget(m_targets[i]);
+        }
+
+        discardBlurResults();
+        glDeleteBuffers(ReadbackBufferCount, m_readbackPBOs);
+
+        glDeleteQueries(GPUTimerQueryCount, GPUTimerQueries);
+
+        m_VertexArrayObject.destroy();
+        m_VertexBuffer.destroy();
+    }
+
     delete m_ShaderProgram_kawase_up;
     delete m_ShaderProgram_kawase_down;
 
-    for (int i = 0; i < m_FBO_vector.size(); i++) {
-        delete m_FBO_vector[i];
+    if (previousContext && previousContext != m_Context) {
+        previousContext->makeCurrent(previousSurface);
+    }
+
+    delete m_Surface;
+    delete m_Context;
+}
+
+bool GLBlurFunctions::isValid() const
+{
+    return m_valid;
+}
+
+bool GLBlurFunctions::makeCurrent()
+{
+    if (!m_valid) {
+        return false;
     }
 
-    delete m_textureToBlur;
+    // Another context of the thread, e.g. of a QOpenGLWidget, may have been
+    // made current since the last call
+    if (QOpenGLContext::currentContext() == m_Context || m_Context->makeCurrent(m_Surface)) {
+        return true;
+    }
+
+    qWarning() << "GLBlurFunctions: cannot make the OpenGL context current";
+    return false;
 }
 
 QImage GLBlurFunctions::blurImage_DualKawase(QImage imageToBlur, int offset, int iterations)
 {
-    // Check to avoid unnecessary texture reallocation
-    if (iterations != m_iterations || imageToBlur != m_imageToBlur) {
-        m_iterations = iterations;
-        m_imageToBlur = imageToBlur.convertToFormat(QImage::Format_RGBA8888);
+    QImage result;
+    blurImage_DualKawase(imageToBlur, offset, iterations, result);
+    return result;
+}
 
-        initFBOTextures();
+bool GLBlurFunctions::blurImage_DualKawase(const QImage& imageToBlur, int offset, int iterations, QImage& result)
+{
+    if (!makeCurrent()) {
+        return false;
     }
 
+    renderBlur(imageToBlur, offset, iterations);
+
+    // Rows are uploaded top down without mirroring, so the first row of the
+    // texture is the top of the image. All passes sample symmetric kernels at
+    // texel centers, which makes them indifferent to the vertical direction,
+    // so the FBO reads back top down as well and no flipped copy is needed
+    const QSize size = m_target->size;
+    if (result.size() != size || result.format() != QImage::Format_ARGB32_Premultiplied || !result.isDetached())
+        result = QImage(size, QImage::Format_ARGB32_Premultiplied);
+
+    m_target->FBOs[0]->bind();
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH, result.bytesPerLine() / 4);
+    glReadPixels(0, 0, size.width(), size.height(), GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, result.bits());
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    m_target->FBOs[0]->release();
+
+    collectGPUTimers();
+    return true;
+}
+
+bool GLBlurFunctions::queueBlur_DualKawase(const QImage& imageToBlur, int offset, int iterations)
+{
+    Q_ASSERT(canQueueBlur());
+
+    if (!makeCurrent()) {
+        return false;
+    }
+
+    renderBlur(imageToBlur, offset, iterations);
+
+    // glReadPixels() into a bound pack buffer only queues the copy, the
+    // fence tells when the GPU got through the blur and the copy
+    const int slot = (m_readbackFirst + m_readbackCount) % ReadbackBufferCount;
+    const QSize size = m_target->size;
+    const int bytes = size.width() * size.height() * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_readbackPBOs[slot]);
+    if (bytes != m_readbackBytes[slot]) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        m_readbackBytes[slot] = bytes;
+    }
+
+    m_target->FBOs[0]->bind();
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, size.width(), size.height(), GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+    m_target->FBOs[0]->release();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    m_readbackFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_readbackSizes[slot] = size;
+    m_readbackCount++;
+
+    // Without a flush the commands may sit in the driver until the next take
+    glFlush();
+    return true;
+}
+
+int GLBlurFunctions::finishedBlurCount()
+{
+    if (m_readbackCount == 0 || !makeCurrent()) {
+        return 0;
+    }
+
+    // Fences signal in order, so the finished blurs are at the front
+    int finished = 0;
+    while (finished < m_readbackCount) {
+        const GLsync fence = m_readbackFences[(m_readbackFirst + finished) % ReadbackBufferCount];
+        const GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED && status != GL_WAIT_FAILED) {
+            break;
+        }
+        finished++;
+    }
+    return finished;
+}
+
+bool GLBlurFunctions::takeBlurResult(QImage* result, bool wait)
+{
+    if (m_readbackCount == 0 || !makeCurrent()) {
+        return false;
+    }
+
+    // A blur not finished in time stays queued for a later take
+    const int slot = m_readbackFirst;
+    const GLenum status = wait ? glClientWaitSync(m_readbackFences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, sg_readbackWaitTimeout)
+                               : glClientWaitSync(m_readbackFences[slot], 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        return false;
+    }
+
+    if (result) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, m_readbackPBOs[slot]);
+        const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, m_readbackBytes[slot], GL_MAP_READ_BIT);
+        if (pixels) {
+            readResult(*result, pixels, m_readbackSizes[slot]);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    glDeleteSync(m_readbackFences[slot]);
+    m_readbackFences[slot] = nullptr;
+    m_readbackFirst = (m_readbackFirst + 1) % ReadbackBufferCount;
+    m_readbackCount--;
+
+    collectGPUTimers();
+
+    return true;
+}
+
+void GLBlurFunctions::discardBlurResults()
+{
+    // Fences of a context that cannot be made current any more are forgotten
+    const bool current = m_readbackCount > 0 && makeCurrent();
+    for (int i = 0; i < m_readbackCount; i++) {
+        const int slot = (m_readbackFirst + i) % ReadbackBufferCount;
+        if (current) {
+            glDeleteSync(m_readbackFences[slot]);
+        }
+        m_readbackFences[slot] = nullptr;
+    }
+    m_readbackFirst = 0;
+    m_readbackCount = 0;
+}
+
+int GLBlurFunctions::pendingBlurCount() const
+{
+    return m_readbackCount;
+}
+
+bool GLBlurFunctions::canQueueBlur() const
+{
+    return m_readbackCount < ReadbackBufferCount;
+}
+
+void GLBlurFunctions::readResult(QImage& result, const void* pixels, const QSize& size)
+{
+    if (result.size() != size || result.format() != QImage::Format_ARGB32_Premultiplied || !result.isDetached())
+        result = QImage(size, QImage::Format_ARGB32_Premultiplied);
+
+    // Pack buffer rows are tightly packed, image rows may be padded
+    const uchar* src = static_cast<const uchar*>(pixels);
+    const int rowBytes = size.width() * 4;
+    for (int y = 0; y < size.height(); y++) {
+        std::memcpy(result.scanLine(y), src + y * rowBytes, rowBytes);
+    }
+}
+
+void GLBlurFunctions::renderBlur(const QImage& imageToBlur, int offset, int iterations)
+{
+    // GL objects change only with the size, the content goes to the texture
+    m_target = takeTarget(imageToBlur.size(), iterations);
+    uploadTexture(imageToBlur);
 
     //Don't record the texture and FBO allocation time
 
 
-    //Start the GPU timer
-    glGenQueries(1, GPUTimerQueries);
-    glBeginQuery(GL_TIME_ELAPSED, GPUTimerQueries[0]);
+    //Start the GPU timer, a full ring drops the oldest query unread
+    collectGPUTimers();
+    if (GPUTimerCount == GPUTimerQueryCount) {
+        GPUTimerFirst = (GPUTimerFirst + 1) % GPUTimerQueryCount;
+        GPUTimerCount--;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, GPUTimerQueries[(GPUTimerFirst + GPUTimerCount) % GPUTimerQueryCount]);
+    GPUTimerCount++;
 
     //Start the CPU timer
     CPUTimer.start();
@@ -98,17 +343,18 @@ QImage GLBlurFunctions::blurImage_DualKawase(QImage imageToBlur, int offset, int
 
     //Initial downsample
     //We only need this helper texture because we can't put a QImage into the texture of a QOpenGLFramebufferObject
-    //Otherwise we would skip this and start the downsampling from m_FBO_vector[0] instead of m_FBO_vector[1]
-    renderToFBO(m_FBO_vector[1], m_textureToBlur->textureId(), m_ShaderProgram_kawase_down);
+    //Otherwise we would skip this and start the downsampling from FBOs[0] instead of FBOs[1]
+    const QVector<QOpenGLFramebufferObject*>& FBOs = m_target->FBOs;
+    renderToFBO(FBOs[1], m_target->texture, m_ShaderProgram_kawase_down);
 
     //Downsample
     for (int i = 1; i < iterations; i++) {
-        renderToFBO(m_FBO_vector[i + 1], m_FBO_vector[i]->texture(), m_ShaderProgram_kawase_down);
+        renderToFBO(FBOs[i + 1], FBOs[i]->texture(), m_ShaderProgram_kawase_down);
     }
 
     //Upsample
     for (int i = iterations; i > 0; i--) {
-        renderToFBO(m_FBO_vector[i - 1], m_FBO_vector[i]->texture(), m_ShaderProgram_kawase_up);
+        renderToFBO(FBOs[i - 1], FBOs[i]->texture(), m_ShaderProgram_kawase_up);
     }
 
     // --------------- blur end ---------------
@@ -116,18 +362,7 @@ QImage GLBlurFunctions::blurImage_DualKawase(QImage imageToBlur, int offset, int
     //Get the CPU timer result
     CPUTimerElapsedTime = CPUTimer.nsecsElapsed();
 
-    //Get the GPU timer result
     glEndQuery(GL_TIME_ELAPSED);
-    GPUTimerAvailable = 0;
-
-    while (!GPUTimerAvailable) {
-        glGetQueryObjectiv(GPUTimerQueries[0], GL_QUERY_RESULT_AVAILABLE, &GPUTimerAvailable);
-    }
-
-    glGetQueryObjectui64v(GPUTimerQueries[0], GL_QUERY_RESULT, &GPUtimerElapsedTime);
-    glDeleteQueries(1, GPUTimerQueries);
-
-    return m_FBO_vector[0]->toImage();
 }
 
 void GLBlurFunctions::renderToFBO(QOpenGLFramebufferObject *targetFBO, GLuint sourceTexture, QOpenGLShaderProgram *shader)
@@ -143,32 +378,93 @@ void GLBlurFunctions::renderToFBO(QOpenGLFramebufferObject *targetFBO, GLuint so
     glDrawArrays(GL_TRIANGLE_FAN, 0, sizeof(sg_vertexes) / sizeof(sg_vertexes[0]));
 }
 
-void GLBlurFunctions::initFBOTextures()
+GLBlurFunctions::BlurTarget* GLBlurFunctions::takeTarget(const QSize& size, int iterations)
 {
-    for (int i = 0; i < m_FBO_vector.size(); i++) {
-        delete m_FBO_vector[i];
+    for (int i = 0; i < m_targets.size(); i++) {
+        if (m_targets[i]->size == size && m_targets[i]->iterations == iterations) {
+            m_targets.move(i, 0);
+            return m_targets[0];
+        }
     }
 
-    m_FBO_vector.clear();
-    m_FBO_vector.append(new QOpenGLFramebufferObject(m_imageToBlur.size(), QOpenGLFramebufferObject::CombinedDepthStencil, GL_TEXTURE_2D));
-
-    for (int i = 1; i <= m_iterations; i++) {
-        m_FBO_vector.append(new QOpenGLFramebufferObject(m_imageToBlur.size() / qPow(2, i), QOpenGLFramebufferObject::CombinedDepthStencil, GL_TEXTURE_2D));
+    // A new size allocates its GL objects once, the least recently
+    // used target makes room for it
+    while (m_targets.size() >= sg_maxBlurTargets) {
+        deleteTarget(m_targets.takeLast());
+    }
 
-        glBindTexture(GL_TEXTURE_2D, m_FBO_vector.last()->texture());
+    BlurTarget* target = new BlurTarget;
+    target->size = size;
+    target->iterations = iterations;
+
+    // Texture storage follows the size, its content is uploaded every frame
+    glGenTextures(1, &target->texture);
+    glBindTexture(GL_TEXTURE_2D, target->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.width(), size.height(), 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+
+    for (int i = 0; i <= iterations; i++) {
+        QOpenGLFramebufferObject* fbo = new QOpenGLFramebufferObject(size / qPow(2, i), QOpenGLFramebufferObject::CombinedDepthStencil, GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, fbo->texture());
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        target->FBOs.append(fbo);
+    }
+
+    m_targets.prepend(target);
+    return target;
+}
+
+void GLBlurFunctions::deleteTarget(BlurTarget* target)
+{
+    glDeleteTextures(1, &target->texture);
+    qDeleteAll(target->FBOs);
+    delete target;
+}
+
+void GLBlurFunctions::uploadTexture(const QImage& image)
+{
+    // 32-bit ARGB in native byte order is GL_BGRA with reversed 8-bit
+    // components on any endianness, other formats are converted first
+    QImage converted;
+    const QImage* source = &image;
+    if (image.format() != QImage::Format_ARGB32_Premultiplied && image.format() != QImage::Format_RGB32) {
+        converted = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        source = &converted;
     }
 
-    delete m_textureToBlur;
+    glBindTexture(GL_TEXTURE_2D, m_target->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, source->bytesPerLine() / 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, source->width(), source->height(), GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, source->constBits());
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
 
-    m_textureToBlur = new QOpenGLTexture(m_imageToBlur.mirrored(), QOpenGLTexture::DontGenerateMipMaps);
-    m_textureToBlur->setWrapMode(QOpenGLTexture::ClampToEdge);
-    m_textureToBlur->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+void GLBlurFunctions::collectGPUTimers()
+{
+    // Queries finish in order, the first one not available ends the scan
+    while (GPUTimerCount > 0) {
+        GLint available = 0;
+        glGetQueryObjectiv(GPUTimerQueries[GPUTimerFirst], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            break;
+        }
+
+        glGetQueryObjectui64v(GPUTimerQueries[GPUTimerFirst], GL_QUERY_RESULT, &GPUtimerElapsedTime);
+        GPUTimerFirst = (GPUTimerFirst + 1) % GPUTimerQueryCount;
+        GPUTimerCount--;
+    }
 }
 
 float GLBlurFunctions::getGPUTime()
 {
+    if (makeCurrent()) {
+        collectGPUTimers();
+    }
+
     float gpuTime = GPUtimerElapsedTime / 1000000.;
     return roundf(gpuTime * 1000) / 1000;
 }
@@ -21,22 +21,80 @@
 class GLBlurFunctions : protected QOpenGLFunctions_3_3_Core
 {
 public:
+    // Queued blurs waiting to be taken, each one owns a pixel buffer. Blurs
+    // of several effects share the queue, so it holds a few frames of them
+    static const int ReadbackBufferCount = 8;
+
     GLBlurFunctions();
     ~GLBlurFunctions();
 
+    // False if no OpenGL 3.3 core context could be made current on an
+    // offscreen surface, none of the blur functions may be called then
+    bool isValid() const;
+
+    // Every function issuing GL calls makes the context current first, so
+    // other contexts of the thread may be used in between. The ones returning
+    // bool return false if that fails and leave their results as they are
+
     QImage blurImage_DualKawase(QImage imageToBlur, int offset, int iterations);
+
+    // Blurs imageToBlur into result, which is reused when it already has the
+    // size of imageToBlur, so blurring frames of a few steady sizes allocates
+    // neither GL objects nor images. The result is premultiplied ARGB32
+    bool blurImage_DualKawase(const QImage& imageToBlur, int offset, int iterations, QImage& result);
+
+    // Starts blurring imageToBlur without waiting for the GPU, the result is
+    // read back into a pixel buffer and picked up by a later takeBlurResult().
+    // The queue must not be full, see canQueueBlur()
+    bool queueBlur_DualKawase(const QImage& imageToBlur, int offset, int iterations);
+
+    // Number of queued blurs at the front of the queue the GPU has finished
+    int finishedBlurCount();
+
+    // Takes the oldest queued blur off the queue and copies it into result,
+    // a null result drops it. With wait it is waited for if not finished,
+    // for a few frames at most. Returns false if nothing was taken, result
+    // is left as is then, e.g. still holding the previous blur
+    bool takeBlurResult(QImage* result, bool wait);
+
+    // Drops the queued blurs, e.g. when they were made with stale settings
+    void discardBlurResults();
+
+    int pendingBlurCount() const;
+    bool canQueueBlur() const;
+
+    // GPU time of the newest blur whose timer query has finished, usually a
+    // few frames old. Collecting it never waits for the GPU
     float getGPUTime();
     float getCPUTime();
 
 private:
+    // Source texture and FBO chain of one image size and iteration count
+    struct BlurTarget
+    {
+        QSize size;
+        int iterations;
+        GLuint texture;
+        QVector<QOpenGLFramebufferObject*> FBOs;
+    };
+
+    bool makeCurrent();
     void renderToFBO(QOpenGLFramebufferObject* targetFBO, GLuint sourceTexture, QOpenGLShaderProgram *shader);
-    void initFBOTextures();
+    void renderBlur(const QImage& imageToBlur, int offset, int iterations);
+    void readResult(QImage& result, const void* pixels, const QSize& size);
+    void collectGPUTimers();
+    BlurTarget* takeTarget(const QSize& size, int iterations);
+    void deleteTarget(BlurTarget* target);
+    void uploadTexture(const QImage& image);
 
     QOpenGLShaderProgram *m_ShaderProgram_kawase_up;
     QOpenGLShaderProgram *m_ShaderProgram_kawase_down;
 
-    QVector<QOpenGLFramebufferObject*> m_FBO_vector;
-    QOpenGLTexture *m_textureToBlur;
+    // Targets of the recently blurred sizes, the most recent one first.
+    // Effects of different sizes share the functions, so one target per
+    // size a queued blur may have keeps alternating sizes allocation free
+    QVector<BlurTarget*> m_targets;
+    BlurTarget* m_target; // of the last rendered blur
 
     QOpenGLVertexArrayObject m_VertexArrayObject;
     QOpenGLBuffer m_VertexBuffer;
@@ -44,12 +102,21 @@ private:
     QOffscreenSurface *m_Surface;
     QOpenGLContext *m_Context;
 
-    int m_iterations;
-    QImage m_imageToBlur;
+    bool m_valid;
+
+    //Readback ring, m_readbackCount slots from m_readbackFirst are pending
+    GLuint m_readbackPBOs[ReadbackBufferCount];
+    GLsync m_readbackFences[ReadbackBufferCount];
+    QSize m_readbackSizes[ReadbackBufferCount];
+    int m_readbackBytes[ReadbackBufferCount];
+    int m_readbackFirst;
+    int m_readbackCount;
 
-    //GPU timer
-    GLuint GPUTimerQueries[1];
-    GLint GPUTimerAvailable;
+    //GPU timer, GPUTimerCount queries from GPUTimerFirst are in flight
+    static const int GPUTimerQueryCount = 4;
+    GLuint GPUTimerQueries[GPUTimerQueryCount];
+    int GPUTimerFirst;
+    int GPUTimerCount;
     GLuint64 GPUtimerElapsedTime;
 
     //CPU timer
@@ -0,0 +1,119 @@
+#include "glblurservice_p.h"
+
+#include <algorithm>
+
+std::shared_ptr<GLBlurService> GLBlurService::instance()
+{
+    static std::weak_ptr<GLBlurService> shared;
+    std::shared_ptr<GLBlurService> service = shared.lock();
+    if (!service)
+    {
+        service = std::make_shared<GLBlurService>();
+        shared = service;
+    }
+    return service;
+}
+
+GLBlurService::GLBlurService()
+{
+    batchTimer_.setSingleShot(true);
+    batchTimer_.setInterval(0);
+    QObject::connect(&batchTimer_, &QTimer::timeout, [this]() { runBatch(); });
+}
+
+quint64 GLBlurService::submit(const void* _client, const QImage& _source, int _iterations)
+{
+    Client& client = clients_[_client];
+    client.request = _source;
+    client.iterations = _iterations;
+    client.requestTicket = nextTicket_++;
+    batchTimer_.start();
+    return client.requestTicket;
+}
+
+quint64 GLBlurService::take(const void* _client, QImage& _result, bool _wait)
+{
+    const auto it = clients_.find(_client);
+    if (it == clients_.end())
+        return 0;
+
+    Client& client = it->second;
+    if (_wait && client.requestTicket != 0)
+        runBatch();
+
+    collect(blur_.finishedBlurCount());
+
+    // fences signal in order, waiting for a blur waits for the ones before it
+    if (_wait && client.resultTicket == 0)
+    {
+        const auto blur = std::find_if(inFlight_.begin(), inFlight_.end(), [_client](const InFlight& _blur) { return _blur.client == _client; });
+        if (blur != inFlight_.end())
+            collect(int(blur - inFlight_.begin()) + 1);
+    }
+
+    const quint64 ticket = client.resultTicket;
+    if (ticket != 0)
+        _result.swap(client.result);
+    client.resultTicket = 0;
+    return ticket;
+}
+
+bool GLBlurService::hasPending(const void* _client) const
+{
+    const auto it = clients_.find(_client);
+    if (it == clients_.end())
+        return false;
+
+    const Client& client = it->second;
+    return client.requestTicket != 0 || client.resultTicket != 0
+        || std::any_of(inFlight_.begin(), inFlight_.end(), [_client](const InFlight& _blur) { return _blur.client == _client; });
+}
+
+void GLBlurService::discard(const void* _client)
+{
+    for (InFlight& blur : inFlight_)
+    {
+        if (blur.client == _client)
+            blur.client = nullptr;
+    }
+    clients_.erase(_client);
+}
+
+void GLBlurService::runBatch()
+{
+    batchTimer_.stop();
+    for (auto& entry : clients_)
+    {
+        Client& client = entry.second;
+        if (client.requestTicket == 0)
+            continue;
+
+        if (!blur_.canQueueBlur())
+            collect(1);
+
+        // without a current context the request waits for the next batch
+        if (!blur_.canQueueBlur() || !blur_.queueBlur_DualKawase(client.request, 2, client.iterations))
+            break;
+        inFlight_.push_back({ entry.first, client.requestTicket });
+        client.request = QImage();
+        client.requestTicket = 0;
+    }
+}
+
+void GLBlurService::collect(int _count)
+{
+    for (int i = 0; i < _count && !inFlight_.empty(); ++i)
+    {
+        const InFlight blur = inFlight_.front();
+        const auto it = blur.client ? clients_.find(blur.client) : clients_.end();
+        const bool superseded = std::any_of(inFlight_.begin() + 1, inFlight_.begin() + (_count - i),
+                                            [&blur](const InFlight& _other) { return _other.client == blur.client; });
+        const bool deliver = it != clients_.end() && !superseded;
+        if (!blur_.takeBlurResult(deliver ? &it->second.result : nullptr, true))
+            return;
+
+        inFlight_.pop_front();
+        if (deliver)
+            it->second.resultTicket = blur.ticket;
+    }
+}
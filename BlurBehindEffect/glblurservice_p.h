@@ -0,0 +1,76 @@
+#pragma once
+#include "glblurfunctions.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <QImage>
+#include <QTimer>
+
+/// GL blur shared by all effects of the process.
+///
+/// A single context with a single set of shader programs is created when
+/// the first effect selects GLBlur and destroyed with the last one. Each
+/// client keeps at most one request waiting, a newer one replaces it.
+/// The waiting requests of all clients go to the GPU in one batch once
+/// control returns to the event loop, after the frame has been painted.
+/// Their readbacks share one queue and are routed back by ticket.
+class GLBlurService
+{
+public:
+    /// The shared service, created on the first call after the last
+    /// holder released the previous one
+    static std::shared_ptr<GLBlurService> instance();
+
+    GLBlurService();
+
+    bool isValid() const { return blur_.isValid(); }
+
+    /// Replaces the waiting request of _client, returns its ticket,
+    /// tickets grow with every request of the process
+    quint64 submit(const void* _client, const QImage& _source, int _iterations);
+
+    /// Swaps the newest finished blur of _client into _result, the previous
+    /// contents of _result are recycled for its next readback. With _wait the
+    /// oldest blur of _client is waited for if none has finished, a waiting
+    /// request is sent to the GPU first. Returns the ticket, 0 if none, also
+    /// when the GPU did not finish in time, _result is left as is then
+    quint64 take(const void* _client, QImage& _result, bool _wait);
+
+    /// True while _client has a request or a blur it did not take yet
+    bool hasPending(const void* _client) const;
+
+    /// Drops the request and the blurs of _client, their readbacks are
+    /// still taken off the shared queue in order, but go nowhere. A client
+    /// must call it before it is destroyed, its address may be reused
+    void discard(const void* _client);
+
+private:
+    struct Client
+    {
+        QImage request;
+        int iterations = 1;
+        quint64 requestTicket = 0; ///< of the waiting request, 0 if none
+        QImage result;
+        quint64 resultTicket = 0;  ///< of the finished blur in result, 0 if none
+    };
+
+    struct InFlight
+    {
+        const void* client; ///< null once discarded
+        quint64 ticket;
+    };
+
+    void runBatch();
+
+    /// Takes _count blurs off the front of the queue, waiting for them if
+    /// needed. Only the newest one of every client among them is read back.
+    /// Stops at the first blur that cannot be taken, it stays queued.
+    void collect(int _count);
+
+    GLBlurFunctions blur_;
+    QTimer batchTimer_;
+    std::map<const void*, Client> clients_;
+    std::deque<InFlight> inFlight_; ///< mirrors the readback queue of blur_
+    quint64 nextTicket_ = 1;
+};
@@ -0,0 +1,152 @@
+#include "glblurservice_p.h"
+#include "blurtest_p.h"
+
+#include <QGuiApplication>
+
+//
+// GL blur service routing test.
+//
+// Readbacks of several clients share one queue, each one must reach the
+// client that submitted it. A client discarded while its blur is in flight,
+// like an effect destroyed between two frames, must never receive it, not
+// even through a new client that reuses its address. Blurs are compared
+// with the ones of a separate GLBlurFunctions on the same driver. Without
+// an OpenGL 3.3 context the test is skipped with exit code 77. Returns
+// non-zero on the first failure.
+//
+
+namespace
+{
+    /// Lets the batch timer send the waiting requests to the GPU
+    void runBatch()
+    {
+        QCoreApplication::processEvents();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication application(argc, argv);
+
+    const std::shared_ptr<GLBlurService> service = GLBlurService::instance();
+    if (!service->isValid())
+    {
+        qWarning("no OpenGL 3.3 core context, skipped: the offscreen platform needs an X server, e.g. xvfb-run -a");
+        return 77;
+    }
+
+    // same size, so only the content tells which blur was delivered
+    const int iterations = 3;
+    const QImage images[] = { randomImage(200, 150, 1), randomImage(200, 150, 2), randomImage(200, 150, 3) };
+    QImage expected[3];
+    {
+        GLBlurFunctions reference;
+        for (int i = 0; i < 3; ++i)
+            reference.blurImage_DualKawase(images[i], 2, iterations, expected[i]);
+    }
+    if (sameImage(expected[0], expected[1]) || sameImage(expected[1], expected[2]))
+    {
+        qWarning("reference blurs are not distinct");
+        return 1;
+    }
+
+    // stand-ins for effects, only their addresses are used
+    int clients[2];
+    const void* a = &clients[0];
+    const void* b = &clients[1];
+    QImage result;
+
+    // every client gets its own readback, whichever takes first
+    {
+        const quint64 ticketA = service->submit(a, images[0], iterations);
+        const quint64 ticketB = service->submit(b, images[1], iterations);
+        runBatch();
+        if (service->take(b, result, true) != ticketB || !sameImage(result, expected[1]))
+        {
+            qWarning("second client did not get its blur");
+            return 1;
+        }
+        if (service->take(a, result, true) != ticketA || !sameImage(result, expected[0]))
+        {
+            qWarning("first client did not get its blur");
+            return 1;
+        }
+        if (service->hasPending(a) || service->hasPending(b))
+        {
+            qWarning("blurs left pending after they were taken");
+            return 1;
+        }
+    }
+
+    // a client discarded mid-flight, the next one at its address gets only its own blur
+    {
+        service->submit(a, images[0], iterations);
+        const quint64 ticketB = service->submit(b, images[1], iterations);
+        runBatch();
+        service->discard(a);
+        if (service->hasPending(a) || service->take(a, result, true) != 0)
+        {
+            qWarning("discarded client still has a blur");
+            return 1;
+        }
+
+        // without waiting only the finished blurs in flight are collected
+        const quint64 ticketA = service->submit(a, images[2], iterations);
+        if (service->take(a, result, false) != 0)
+        {
+            qWarning("client reusing a discarded address got a stale blur");
+            return 1;
+        }
+        if (service->take(a, result, true) != ticketA || !sameImage(result, expected[2]))
+        {
+            qWarning("client reusing a discarded address got a stale blur");
+            return 1;
+        }
+        if (service->take(b, result, true) != ticketB || !sameImage(result, expected[1]))
+        {
+            qWarning("blur of a discarded client disturbed another client");
+            return 1;
+        }
+    }
+
+    // a request discarded before its batch never reaches the GPU
+    {
+        service->submit(a, images[0], iterations);
+        service->discard(a);
+        runBatch();
+        if (service->hasPending(a) || service->take(a, result, false) != 0)
+        {
+            qWarning("discarded request was blurred");
+            return 1;
+        }
+    }
+
+    // a newer blur of the same client supersedes an older one, never the other way around
+    {
+        const quint64 older = service->submit(a, images[0], iterations);
+        runBatch();
+        const quint64 newer = service->submit(a, images[1], iterations);
+        runBatch();
+        quint64 ticket = service->take(a, result, true);
+        if (ticket == older)
+        {
+            if (!sameImage(result, expected[0]))
+            {
+                qWarning("older blur has the wrong content");
+                return 1;
+            }
+            ticket = service->take(a, result, true);
+        }
+        if (ticket != newer || !sameImage(result, expected[1]) || service->hasPending(a))
+        {
+            qWarning("newer blur was not delivered last");
+            return 1;
+        }
+    }
+
+    service->discard(a);
+    service->discard(b);
+    return 0;
+}
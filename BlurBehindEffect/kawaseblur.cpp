@@ -0,0 +1,277 @@
+#include "blur.h"
+#include "blurparallel_p.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KAWASE_SSE2
+#include <emmintrin.h>
+#endif
+
+//
+// CPU port of shaders/dual_kawase_down.frag and shaders/dual_kawase_up.frag.
+//
+// Every pass renders a level of the pyramid sampling the previous one with
+// bilinear filtering and clamp to edge wrapping, exactly like the GL path
+// does with GL_LINEAR textures. Levels are kept as premultiplied ARGB32,
+// which matches the precision of the RGBA8 framebuffers.
+//
+
+namespace
+{
+#if defined(KAWASE_SSE2)
+    typedef __m128 Vec4;
+
+    inline Vec4 unpack(quint32 _pixel)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(int(_pixel)), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    }
+
+    inline quint32 pack(Vec4 _v)
+    {
+        __m128i v = _mm_cvtps_epi32(_v);
+        v = _mm_packs_epi32(v, v);
+        return quint32(_mm_cvtsi128_si32(_mm_packus_epi16(v, v)));
+    }
+
+    inline Vec4 load(const float* _p) { return _mm_loadu_ps(_p); }
+    inline void store(float* _p, Vec4 _v) { _mm_storeu_ps(_p, _v); }
+    inline Vec4 splat(float _f) { return _mm_set1_ps(_f); }
+    inline Vec4 add(Vec4 _a, Vec4 _b) { return _mm_add_ps(_a, _b); }
+    inline Vec4 mul(Vec4 _a, Vec4 _b) { return _mm_mul_ps(_a, _b); }
+    inline Vec4 lerp(Vec4 _a, Vec4 _b, Vec4 _t) { return _mm_add_ps(_a, _mm_mul_ps(_mm_sub_ps(_b, _a), _t)); }
+#else
+    struct Vec4
+    {
+        float v[4];
+    };
+
+    inline Vec4 unpack(quint32 _pixel)
+    {
+        return { { float(_pixel & 0xff), float((_pixel >> 8) & 0xff), float((_pixel >> 16) & 0xff), float(_pixel >> 24) } };
+    }
+
+    inline quint32 pack(Vec4 _v)
+    {
+        quint32 pixel = 0;
+        for (int c = 0; c < 4; ++c)
+            pixel |= quint32(std::clamp(int(std::nearbyint(_v.v[c])), 0, 255)) << (8 * c);
+        return pixel;
+    }
+
+    inline Vec4 load(const float* _p) { return { { _p[0], _p[1], _p[2], _p[3] } }; }
+
+    inline void store(float* _p, Vec4 _v)
+    {
+        for (int c = 0; c < 4; ++c)
+            _p[c] = _v.v[c];
+    }
+
+    inline Vec4 splat(float _f) { return { { _f, _f, _f, _f } }; }
+
+    inline Vec4 add(Vec4 _a, Vec4 _b)
+    {
+        for (int c = 0; c < 4; ++c)
+            _a.v[c] += _b.v[c];
+        return _a;
+    }
+
+    inline Vec4 mul(Vec4 _a, Vec4 _b)
+    {
+        for (int c = 0; c < 4; ++c)
+            _a.v[c] *= _b.v[c];
+        return _a;
+    }
+
+    inline Vec4 lerp(Vec4 _a, Vec4 _b, Vec4 _t)
+    {
+        for (int c = 0; c < 4; ++c)
+            _a.v[c] += (_b.v[c] - _a.v[c]) * _t.v[c];
+        return _a;
+    }
+#endif
+
+    /// Pixels of a single pyramid level
+    struct KawaseLevel
+    {
+        quint32* bits;
+        int width;
+        int height;
+        int stride; ///< in pixels
+
+        const quint32* scanLine(int _y) const { return bits + std::ptrdiff_t(_y) * stride; }
+        quint32* scanLine(int _y) { return bits + std::ptrdiff_t(_y) * stride; }
+    };
+
+    /// Bilinear filter tap of a single axis with clamp to edge wrapping
+    struct KawaseTap
+    {
+        int i0;
+        int i1;
+        float f;
+
+        /// _coord is measured in texels of the sampled axis, texel centers are at i + 0.5
+        static KawaseTap at(float _coord, int _size)
+        {
+            const float c = std::clamp(_coord - 0.5f, 0.0f, float(_size - 1));
+            const int i0 = int(c);
+            return { i0, std::min(i0 + 1, _size - 1), c - i0 };
+        }
+    };
+
+    /// Shader samples grouped by rows sharing the same horizontal taps,
+    /// offsets are in (halfpixel * offset) units, weights are normalized
+    struct KawaseRows
+    {
+        int dy[2];
+        int rowCount;
+        struct
+        {
+            int dx;
+            float weight;
+        } taps[2];
+        int tapCount;
+    };
+
+    // center * 4 + four diagonal samples, divided by 8
+    constexpr KawaseRows downSamples[] = {
+        { {  0, 0 }, 1, { { 0, 4.0f / 8.0f }, {} }, 1 },
+        { { -1, 1 }, 2, { { -1, 1.0f / 8.0f }, { 1, 1.0f / 8.0f } }, 2 }
+    };
+
+    // four axis samples at 2 units plus four diagonal ones * 2, divided by 12
+    constexpr KawaseRows upSamples[] = {
+        { {  0, 0 }, 1, { { -2, 1.0f / 12.0f }, { 2, 1.0f / 12.0f } }, 2 },
+        { { -1, 1 }, 2, { { -1, 2.0f / 12.0f }, { 1, 2.0f / 12.0f } }, 2 },
+        { { -2, 2 }, 2, { {  0, 1.0f / 12.0f }, {} }, 1 }
+    };
+
+    /// Renders _target from _source like a fragment shader with given
+    /// samples would do, offsets are in units of (halfpixel * _offset)
+    template<std::size_t N>
+    void kawasePass(const KawaseLevel& _source, KawaseLevel _target, const KawaseRows (&_samples)[N], int _offset, int _threadCount)
+    {
+        // halfpixel is computed for the target, as in GLBlurFunctions::renderToFBO()
+        const float scaleX = float(_source.width) / _target.width;
+        const float scaleY = float(_source.height) / _target.height;
+        const float unitX = 0.5f * _offset * scaleX;
+        const float unitY = 0.5f * _offset * scaleY;
+
+        // horizontal taps are shared by all rows, they are laid out per
+        // target pixel with the bilinear and the sample weights folded in
+        struct Tap
+        {
+            int o0;
+            int o1;
+            float w0;
+            float w1;
+        };
+        int tapCount = 0;
+        for (const KawaseRows& rows : _samples)
+            tapCount += rows.tapCount;
+        std::vector<Tap> taps(std::size_t(tapCount) * _target.width);
+        for (int x = 0; x < _target.width; ++x)
+        {
+            Tap* tap = taps.data() + std::size_t(x) * tapCount;
+            for (std::size_t g = 0; g < N; ++g)
+            {
+                for (int t = 0; t < _samples[g].tapCount; ++t, ++tap)
+                {
+                    const KawaseTap tx = KawaseTap::at((x + 0.5f) * scaleX + _samples[g].taps[t].dx * unitX, _source.width);
+                    const float w = _samples[g].taps[t].weight;
+                    const int base = int(g) * _source.width * 4;
+                    *tap = { base + tx.i0 * 4, base + tx.i1 * 4, w * (1.0f - tx.f), w * tx.f };
+                }
+            }
+        }
+
+        // sampling is separable: rows of a group are blended vertically and
+        // summed once per target row, then every tap is a horizontal lerp
+        parallelFor(_target.height, _threadCount, [&](int _begin, int _end) {
+            std::vector<float> blended(N * _source.width * 4);
+            for (int y = _begin; y < _end; ++y)
+            {
+                for (std::size_t g = 0; g < N; ++g)
+                {
+                    float* row = blended.data() + g * _source.width * 4;
+                    for (int i = 0; i < _samples[g].rowCount; ++i)
+                    {
+                        const KawaseTap ty = KawaseTap::at((y + 0.5f) * scaleY + _samples[g].dy[i] * unitY, _source.height);
+                        const quint32* r0 = _source.scanLine(ty.i0);
+                        const quint32* r1 = _source.scanLine(ty.i1);
+                        const Vec4 fy = splat(ty.f);
+                        for (int x = 0; x < _source.width; ++x)
+                        {
+                            Vec4 v = lerp(unpack(r0[x]), unpack(r1[x]), fy);
+                            if (i > 0)
+                                v = add(v, load(row + x * 4));
+                            store(row + x * 4, v);
+                        }
+                    }
+                }
+
+                quint32* dst = _target.scanLine(y);
+                const Tap* tap = taps.data();
+                for (int x = 0; x < _target.width; ++x)
+                {
+                    Vec4 sum = splat(0.0f);
+                    for (int t = 0; t < tapCount; ++t, ++tap)
+                        sum = add(sum, add(mul(load(blended.data() + tap->o0), splat(tap->w0)),
+                                           mul(load(blended.data() + tap->o1), splat(tap->w1))));
+                    dst[x] = pack(sum);
+                }
+            }
+        });
+    }
+}
+
+bool kawaseBlur(const BlurImageRef& _image, int _offset, int _iterations, int _threadCount)
+{
+    if (_image.isNull() || _image.depth() != 32 || (_image.bytesPerLine % 4) != 0)
+        return false;
+
+    // level sizes follow QSize / 2^i of the GL path, levels never collapse
+    std::vector<QSize> sizes{ QSize(_image.width, _image.height) };
+    for (int i = 1; i <= _iterations; ++i)
+    {
+        const QSize s = QSize(_image.width, _image.height) / std::pow(2.0, i);
+        if (s.width() < 1 || s.height() < 1)
+            break;
+        sizes.push_back(s);
+    }
+    if (sizes.size() < 2)
+        return true;
+
+    std::size_t total = 0;
+    for (std::size_t i = 1; i < sizes.size(); ++i)
+        total += std::size_t(sizes[i].width()) * sizes[i].height();
+    std::vector<quint32> buffer(total);
+
+    std::vector<KawaseLevel> levels;
+    levels.push_back({ reinterpret_cast<quint32*>(_image.bits), _image.width, _image.height, _image.bytesPerLine / 4 });
+    quint32* bits = buffer.data();
+    for (std::size_t i = 1; i < sizes.size(); ++i)
+    {
+        levels.push_back({ bits, sizes[i].width(), sizes[i].height(), sizes[i].width() });
+        bits += std::size_t(sizes[i].width()) * sizes[i].height();
+    }
+
+    const int depth = int(levels.size()) - 1;
+    for (int i = 0; i < depth; ++i)
+        kawasePass(levels[i], levels[i + 1], downSamples, _offset, _threadCount);
+    for (int i = depth; i > 0; --i)
+        kawasePass(levels[i], levels[i - 1], upSamples, _offset, _threadCount);
+
+    return true;
+}
+
+QImage kawaseBlurImage(const QImage& _image, int _offset, int _iterations, int _threadCount)
+{
+    QImage result = _image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    kawaseBlur(BlurImageRef(result), _offset, _iterations, _threadCount);
+    return result;
+}
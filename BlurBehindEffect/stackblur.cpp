@@ -1,100 +1,282 @@
 #include "blur.h"
+#include "stackblur_p.h"
+#include "blurparallel_p.h"
 
 #include <vector>
-#include <memory>
-#include <QThreadPool>
+#include <cstring>
+#include <utility>
+#include <type_traits>
+#include <QThread>
 #include <QImage>
 
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_MSVC)
+#include <intrin.h>
+#endif
 
-void stackblurJob(unsigned char* src,        ///< input image data
-                  const unsigned int w,      ///< image width
-                  const unsigned int h,      ///< image height
-                  const unsigned int radius, ///< blur intensity (should be in 2..254 range)
-                  const int cores,           ///< total number of working threads
-                  const int core,            ///< current thread number
-                  const int step,            ///< step of processing (1,2)
-                  unsigned char* stack       ///< stack buffer
-                  );
 
-class StackBlurTask : public QRunnable
+namespace
 {
-public:
-    unsigned char* src_;
-    unsigned int w_;
-    unsigned int h_;
-    unsigned int radius_;
-    int cores_;
-    int core_;
-    int step_;
-    unsigned char* stack_;
-
-    StackBlurTask(unsigned char* _src, unsigned int _w, unsigned int _h, unsigned int _radius, int _cores, int _core, int _step, unsigned char* _stack)
-        : src_(_src)
-        , w_(_w)
-        , h_(_h)
-        , radius_(_radius)
-        , cores_(_cores)
-        , core_(_core)
-        , step_(_step)
-        , stack_(_stack)
+    struct CpuFeatures
+    {
+        bool sse2 = false;
+        bool sse41 = false;
+        bool avx2 = false;
+
+        CpuFeatures()
+        {
+#if defined(Q_PROCESSOR_X86) && (defined(Q_CC_GNU) || defined(Q_CC_CLANG))
+            __builtin_cpu_init();
+            sse2 = __builtin_cpu_supports("sse2");
+            sse41 = __builtin_cpu_supports("sse4.1");
+            avx2 = __builtin_cpu_supports("avx2");
+#elif defined(Q_PROCESSOR_X86) && defined(Q_CC_MSVC)
+            int info[4];
+            __cpuid(info, 0);
+            const int maxLeaf = info[0];
+            __cpuid(info, 1);
+            sse2 = (info[3] & (1 << 26)) != 0;
+            sse41 = (info[2] & (1 << 19)) != 0;
+            // AVX2 also requires OS support of YMM registers state
+            const bool osxsave = (info[2] & (1 << 27)) != 0;
+            if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 0x6) == 0x6)
+            {
+                __cpuidex(info, 7, 0);
+                avx2 = (info[1] & (1 << 5)) != 0;
+            }
+#endif
+        }
+    };
+
+    const CpuFeatures& cpuFeatures()
     {
+        static const CpuFeatures features;
+        return features;
     }
+}
+
+bool stackblurKernelSupported(StackBlurKernel kernel)
+{
+    return stackblurKernelJob(kernel) != nullptr;
+}
+
+StackBlurKernel stackblurBestKernel()
+{
+    static const StackBlurKernel best = []
+    {
+        for (auto kernel : { StackBlurKernel::AVX2, StackBlurKernel::SSE41, StackBlurKernel::SSE2 })
+            if (stackblurKernelSupported(kernel))
+                return kernel;
+        return StackBlurKernel::Scalar;
+    }();
+    return best;
+}
 
-    void run() override
+StackBlurJob stackblurKernelJob(StackBlurKernel kernel)
+{
+    switch (kernel)
     {
-        stackblurJob(src_, w_, h_, radius_, cores_, core_, step_, stack_);
+    case StackBlurKernel::Scalar:
+        return &stackblurJob;
+#if defined(Q_PROCESSOR_X86)
+    case StackBlurKernel::SSE2:
+        return cpuFeatures().sse2 ? &stackblurJob_sse2 : nullptr;
+    case StackBlurKernel::SSE41:
+        return cpuFeatures().sse41 ? &stackblurJob_sse4 : nullptr;
+    case StackBlurKernel::AVX2:
+        return cpuFeatures().avx2 ? &stackblurJob_avx2 : nullptr;
+#endif
+    default:
+        break;
     }
-};
+    return nullptr;
+}
+
+StackBlurJob stackblurKernelJob_rgb32(StackBlurKernel kernel)
+{
+    if (!stackblurKernelSupported(kernel))
+        return nullptr;
 
-constexpr unsigned int minRadius() noexcept { return 2; }
-constexpr unsigned int maxRadius() noexcept { return 254; }
+    switch (kernel)
+    {
+    case StackBlurKernel::Scalar:
+        return &stackblurJob_rgb32;
+#if defined(Q_PROCESSOR_X86)
+    case StackBlurKernel::SSE2:
+        return &stackblurJob_rgb32_sse2;
+    case StackBlurKernel::SSE41:
+        return &stackblurJob_rgb32_sse4;
+    case StackBlurKernel::AVX2:
+        return &stackblurJob_rgb32_avx2;
+#endif
+    default:
+        break;
+    }
+    return nullptr;
+}
 
 
 namespace
 {
-    constexpr unsigned short const stackblur_mul[] =
+    template<class F, unsigned int... K>
+    inline void unrolled(F&& f, std::integer_sequence<unsigned int, K...>)
     {
-            512,512,456,512,328,456,335,512,405,328,271,456,388,335,292,512,
-            454,405,364,328,298,271,496,456,420,388,360,335,312,292,273,512,
-            482,454,428,405,383,364,345,328,312,298,284,271,259,496,475,456,
-            437,420,404,388,374,360,347,335,323,312,302,292,282,273,265,512,
-            497,482,468,454,441,428,417,405,394,383,373,364,354,345,337,328,
-            320,312,305,298,291,284,278,271,265,259,507,496,485,475,465,456,
-            446,437,428,420,412,404,396,388,381,374,367,360,354,347,341,335,
-            329,323,318,312,307,302,297,292,287,282,278,273,269,265,261,512,
-            505,497,489,482,475,468,461,454,447,441,435,428,422,417,411,405,
-            399,394,389,383,378,373,368,364,359,354,350,345,341,337,332,328,
-            324,320,316,312,309,305,301,298,294,291,287,284,281,278,274,271,
-            268,265,262,259,257,507,501,496,491,485,480,475,470,465,460,456,
-            451,446,442,437,433,428,424,420,416,412,408,404,400,396,392,388,
-            385,381,377,374,370,367,363,360,357,354,350,347,344,341,338,335,
-            332,329,326,323,320,318,315,312,310,307,304,302,299,297,294,292,
-            289,287,285,282,280,278,275,273,271,269,267,265,263,261,259
-    };
+        (f(std::integral_constant<unsigned int, K>()), ...);
+    }
 
-    constexpr unsigned char const stackblur_shr[] =
+    /// Calls f(k) for k in [0, N). Sums of channels scattered over the pixel
+    /// stay in registers only if the loop is unrolled with k known at compile
+    /// time, plain loops over densely packed bytes are left to the vectorizer.
+    template<unsigned int N, bool Unroll, class F>
+    inline void forEachValue(F&& f)
     {
-            9, 11, 12, 13, 13, 14, 14, 15, 15, 15, 15, 16, 16, 16, 16, 17,
-            17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 18, 18, 19,
-            19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 20, 20, 20,
-            20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 21,
-            21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
-            21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22,
-            22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
-            22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 23,
-            23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
-            23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
-            23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
-            23, 23, 23, 23, 23, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
-            24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
-            24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
-            24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
-            24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24
-    };
+        if constexpr (Unroll)
+            unrolled(f, std::make_integer_sequence<unsigned int, N>());
+        else
+            for (unsigned int k = 0; k < N; ++k)
+                f(k);
+    }
+
+    /// Scalar stackblur of Lines adjacent lines, only Channels bytes starting at
+    /// Offset of every PixelSize bytes pixel are blurred, the rest is untouched.
+    /// In the vertical pass lines are neighbour columns, so memory is accessed
+    /// in contiguous runs.
+    template<unsigned int Channels, unsigned int PixelSize, unsigned int Offset, unsigned int Lines>
+    void stackblurLinesPacked(unsigned char* src,        ///< first pixel of the first line
+                              const unsigned int len,    ///< line length in pixels
+                              const std::ptrdiff_t step, ///< distance between adjacent pixels of a line
+                              const unsigned int radius,
+                              const unsigned int mul_sum,
+                              const unsigned int shr_sum,
+                              unsigned char* stack)
+    {
+        constexpr unsigned int N = Channels * Lines;
+        static_assert(N <= stackblurMaxLines() * 4, "stack buffer is too small");
+        constexpr bool unroll = Channels != PixelSize || N <= 4;
+        auto at = [](unsigned int k) constexpr { return (k / Channels) * PixelSize + Offset + k % Channels; };
+
+        unsigned int sum[N] = {};
+        unsigned int sum_in[N] = {};
+        unsigned int sum_out[N] = {};
+
+        const unsigned int lm = len - 1;
+        const unsigned int div = (radius * 2) + 1;
+
+        unsigned char* src_ptr = src;
+        unsigned char* stack_ptr;
+
+        for(unsigned int i = 0; i <= radius; i++)
+        {
+            stack_ptr = &stack[N * i];
+            forEachValue<N, unroll>([&](auto k)
+            {
+                stack_ptr[k] = src_ptr[at(k)];
+                sum[k] += stack_ptr[k] * (i + 1);
+                sum_out[k] += stack_ptr[k];
+            });
+        }
+
+        for(unsigned int i = 1; i <= radius; i++)
+        {
+            if (i <= lm) src_ptr += step;
+            stack_ptr = &stack[N * (i + radius)];
+            forEachValue<N, unroll>([&](auto k)
+            {
+                stack_ptr[k] = src_ptr[at(k)];
+                sum[k] += stack_ptr[k] * (radius + 1 - i);
+                sum_in[k] += stack_ptr[k];
+            });
+        }
+
+        unsigned int sp = radius;
+        unsigned int xp = radius;
+        if (xp > lm) xp = lm;
+        src_ptr = src + xp * step;
+        unsigned char* dst_ptr = src;
+        for(unsigned int x = 0; x < len; x++)
+        {
+            forEachValue<N, unroll>([&](auto k)
+            {
+                dst_ptr[at(k)] = (unsigned char)((sum[k] * mul_sum) >> shr_sum);
+                sum[k] -= sum_out[k];
+            });
+
+            unsigned int stack_start = sp + div - radius;
+            if (stack_start >= div) stack_start -= div;
+            stack_ptr = &stack[N * stack_start];
+
+            if(xp < lm)
+            {
+                src_ptr += step;
+                ++xp;
+            }
+
+            forEachValue<N, unroll>([&](auto k)
+            {
+                sum_out[k] -= stack_ptr[k];
+                stack_ptr[k] = src_ptr[at(k)];
+                sum_in[k] += stack_ptr[k];
+                sum[k] += sum_in[k];
+            });
+
+            ++sp;
+            if (sp >= div) sp = 0;
+            stack_ptr = &stack[N * sp];
+
+            forEachValue<N, unroll>([&](auto k)
+            {
+                sum_out[k] += stack_ptr[k];
+                sum_in[k] -= stack_ptr[k];
+            });
+
+            dst_ptr += step;
+        }
+    }
 
-    constexpr auto precomputedArraySize = 255;
-    static_assert(std::size(stackblur_mul) == precomputedArraySize);
-    static_assert(std::size(stackblur_shr) == precomputedArraySize);
+    /// Counterpart of stackblurJob() for pixel layouts other than 4 channels of 4 bytes
+    template<unsigned int Channels, unsigned int PixelSize, unsigned int Offset>
+    void stackblurJobPacked(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                            const unsigned int radius, const int cores, const int core,
+                            const int step, unsigned char* stack)
+    {
+        const unsigned int mul_sum = stackblur_mul[radius];
+        const unsigned int shr_sum = stackblur_shr[radius];
+
+        if (step == 1)
+        {
+            const unsigned int minY = core * h / cores;
+            const unsigned int maxY = (core + 1) * h / cores;
+
+            for(unsigned int y = minY; y < maxY; y++)
+                stackblurLinesPacked<Channels, PixelSize, Offset, 1>(src + std::size_t(stride) * y, w, PixelSize, radius, mul_sum, shr_sum, stack);
+        }
+
+        if (step == 2)
+        {
+            constexpr unsigned int block = stackblurMaxLines() * 4 / Channels;
+
+            const unsigned int minX = core * w / cores;
+            const unsigned int maxX = (core + 1) * w / cores;
+
+            unsigned int x = minX;
+            for(; x + block <= maxX; x += block)
+                stackblurLinesPacked<Channels, PixelSize, Offset, block>(src + x * PixelSize, h, stride, radius, mul_sum, shr_sum, stack);
+            for(; x < maxX; x++)
+                stackblurLinesPacked<Channels, PixelSize, Offset, 1>(src + x * PixelSize, h, stride, radius, mul_sum, shr_sum, stack);
+        }
+    }
+}
+
+void stackblurJob_a8(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                     const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    stackblurJobPacked<1, 1, 0>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+void stackblurJob_rgb32(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                        const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    // 0xffRRGGBB pixels, the color bytes follow the alpha one on big endian machines
+    stackblurJobPacked<3, 4, (Q_BYTE_ORDER == Q_BIG_ENDIAN) ? 1 : 0>(src, w, h, stride, radius, cores, core, step, stack);
 }
 
 
@@ -102,6 +284,7 @@ namespace
 void stackblurJob(unsigned char* src,   ///< input image data
                   const unsigned int w,               ///< image width
                   const unsigned int h,               ///< image height
+                  const unsigned int stride,          ///< distance between scanlines in bytes
                   const unsigned int radius,          ///< blur intensity (should be in 2..254 range)
                   const int cores,                    ///< total number of working threads
                   const int core,                     ///< current thread number
@@ -132,7 +315,6 @@ void stackblurJob(unsigned char* src,   ///< input image data
 
     const unsigned int wm = w - 1;
     const unsigned int hm = h - 1;
-    const unsigned int w4 = w * 4;
     const unsigned int div = (radius * 2) + 1;
     const unsigned int mul_sum = stackblur_mul[radius];
     const unsigned char shr_sum = stackblur_shr[radius];
@@ -149,7 +331,7 @@ void stackblurJob(unsigned char* src,   ///< input image data
                     sum_in_r = sum_in_g = sum_in_b = sum_in_a =
                     sum_out_r = sum_out_g = sum_out_b = sum_out_a = 0;
 
-            src_ptr = src + w4 * y; // start of line (0,y)
+            src_ptr = src + stride * y; // start of line (0,y)
 
             for(i = 0; i <= radius; i++)
             {
@@ -189,8 +371,8 @@ void stackblurJob(unsigned char* src,   ///< input image data
             sp = radius;
             xp = radius;
             if (xp > wm) xp = wm;
-            src_ptr = src + 4 * (xp + y * w); //   img.pix_ptr(xp, y);
-            dst_ptr = src + y * w4; // img.pix_ptr(0, y);
+            src_ptr = src + y * stride + 4 * xp; //   img.pix_ptr(xp, y);
+            dst_ptr = src + y * stride; // img.pix_ptr(0, y);
             for(x = 0; x < w; x++)
             {
                 dst_ptr[0] = (sum_r * mul_sum) >> shr_sum;
@@ -280,7 +462,7 @@ void stackblurJob(unsigned char* src,   ///< input image data
             }
             for(i = 1; i <= radius; i++)
             {
-                if(i <= hm) src_ptr += w4; // +stride
+                if(i <= hm) src_ptr += stride;
 
                 stack_ptr = &stack[4 * (i + radius)];
                 stack_ptr[0] = src_ptr[0];
@@ -300,7 +482,7 @@ void stackblurJob(unsigned char* src,   ///< input image data
             sp = radius;
             yp = radius;
             if (yp > hm) yp = hm;
-            src_ptr = src + 4 * (x + yp * w); // img.pix_ptr(x, yp);
+            src_ptr = src + yp * stride + 4 * x; // img.pix_ptr(x, yp);
             dst_ptr = src + 4 * x; 			  // img.pix_ptr(x, 0);
             for(y = 0; y < h; y++)
             {
@@ -308,7 +490,7 @@ void stackblurJob(unsigned char* src,   ///< input image data
                 dst_ptr[1] = (sum_g * mul_sum) >> shr_sum;
                 dst_ptr[2] = (sum_b * mul_sum) >> shr_sum;
                 dst_ptr[3] = (sum_a * mul_sum) >> shr_sum;
-                dst_ptr += w4;
+                dst_ptr += stride;
 
                 sum_r -= sum_out_r;
                 sum_g -= sum_out_g;
@@ -326,7 +508,7 @@ void stackblurJob(unsigned char* src,   ///< input image data
 
                 if(yp < hm)
                 {
-                    src_ptr += w4; // stride
+                    src_ptr += stride;
                     ++yp;
                 }
 
@@ -364,52 +546,114 @@ void stackblurJob(unsigned char* src,   ///< input image data
 void stackblur(unsigned char* src,  ///< input image data
                const unsigned int w,           ///< image width
                const unsigned int h,           ///< image height
+               const unsigned int stride,      ///< distance between scanlines in bytes
+               const unsigned int radius,      ///< blur intensity (should be in 2..254 range)
+               const int coreCount,            ///< core count, -1 = auto multithreading
+               StackBlurKernel kernel          ///< kernel implementation
+               )
+{
+    if (stride < w * 4)
+        return;
+
+    stackblur(src, w, h, stride, radius, coreCount, stackblurKernelJob(kernel));
+}
+
+void stackblur(unsigned char* src,  ///< input image data
+               const unsigned int w,           ///< image width
+               const unsigned int h,           ///< image height
+               const unsigned int stride,      ///< distance between scanlines in bytes
                const unsigned int radius,      ///< blur intensity (should be in 2..254 range)
-               const int coreCount             ///< core count, -1 = auto multithreading
+               const int coreCount,            ///< core count, -1 = auto multithreading
+               StackBlurJob job                ///< pass function matching the pixel layout
                )
 {
     //im_assert(src);
     //im_assert(radius <= maxRadius() && radius >= minRadius());
-    if (radius > maxRadius() || radius < minRadius() || !src)
+    if (radius > maxRadius() || radius < minRadius() || !src || !job)
         return;
 
     const auto maxCores = QThread::idealThreadCount();
     const auto cores = std::clamp(coreCount == -1 ? maxCores : coreCount, 1, maxCores);
-    const unsigned int div = (radius * 2) + 1;
-    std::vector<unsigned char> stack(div * 4 * cores);
+    const unsigned int stackSize = stackblurStackSize(radius);
 
-    if (cores <= 1)
+    // the calling thread waits for the workers, so its buffer holds the
+    // stacks of all of them and is reused by the following calls
+    thread_local std::vector<unsigned char> stack;
+    if (stack.size() < stackSize * cores)
+        stack.resize(stackSize * cores);
+    unsigned char* const stacks = stack.data();
+
+    // the vertical pass starts once every line is blurred horizontally
+    for (int step = 1; step <= 2; ++step)
     {
-        // no multithreading
-        stackblurJob(src, w, h, radius, 1, 0, 1, stack.data());
-        stackblurJob(src, w, h, radius, 1, 0, 2, stack.data());
+        parallelFor(cores, cores, [&](int _begin, int _end) {
+            for (int core = _begin; core < _end; ++core)
+                job(src, w, h, stride, radius, cores, core, step, stacks + stackSize * core);
+        });
     }
-    else
-    {
-        QThreadPool pool;
+}
 
-        std::vector<std::unique_ptr<StackBlurTask>> workers(cores);
-        for (int i = 0; i < cores; ++i)
-        {
-            workers[i] = std::make_unique<StackBlurTask>(src, w, h, radius, cores, i, 1, stack.data() + div * 4 * i);
-            workers[i]->setAutoDelete(false);
-            pool.start(workers[i].get());
-        }
-        pool.waitForDone();
 
-        for (int i = 0; i < cores; ++i)
-        {
-            workers[i]->step_ = 2;
-            pool.start(workers[i].get());
-        }
-        pool.waitForDone();
-    }
-}
+bool stackBlur(const BlurImageRef& _image, int _radius, int _threadCount)
+{
+    if (_image.isNull() || _image.bytesPerLine < _image.width * _image.depth() / 8)
+        return false;
+
+    const StackBlurKernel kernel = stackblurBestKernel();
+    StackBlurJob job = nullptr;
+    if (_image.isSingleChannel())
+        job = &stackblurJob_a8;
+    else if (_image.format == QImage::Format_RGB32)
+        job = stackblurKernelJob_rgb32(kernel);
+    else if (_image.depth() == 32)
+        job = stackblurKernelJob(kernel);
+    else
+        return false;
 
+    stackblur(_image.bits, _image.width, _image.height, _image.bytesPerLine, _radius, _threadCount, job);
+    return true;
+}
 
 QImage stackBlurImage(const QImage& _image, int _radius, int _threadCount)
 {
+    // the image keeps its format unless the kernels do not support it
     QImage result = _image;
-    stackblur(result.bits(), _image.width(), _image.height(), _radius, _threadCount);
+    if (!stackBlur(BlurImageRef(result), _radius, _threadCount))
+    {
+        result = _image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        stackBlur(BlurImageRef(result), _radius, _threadCount);
+    }
+    return result;
+}
+
+QImage shadowImage(const QImage& _shape, int _radius, const QColor& _color, int _threadCount)
+{
+    const int margin = std::max(_radius, 0);
+    const QImage coverage = _shape.convertToFormat(QImage::Format_Alpha8);
+
+    // mask has room for the blurred edges on every side
+    QImage mask(_shape.width() + 2 * margin, _shape.height() + 2 * margin, QImage::Format_Alpha8);
+    mask.fill(0);
+    for (int y = 0; y < coverage.height(); ++y)
+        std::memcpy(mask.scanLine(y + margin) + margin, coverage.constScanLine(y), coverage.width());
+
+    if (_radius <= int(maxRadius()))
+        stackBlur(BlurImageRef(mask), _radius, _threadCount);
+    else
+        slidingBoxBlur(BlurImageRef(mask), _radius, 3, _threadCount);
+
+    const QRgb color = qPremultiply(_color.rgba());
+    QImage result(mask.size(), QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < mask.height(); ++y)
+    {
+        const uchar* alpha = mask.constScanLine(y);
+        QRgb* line = reinterpret_cast<QRgb*>(result.scanLine(y));
+        for (int x = 0; x < mask.width(); ++x)
+        {
+            const uint a = alpha[x];
+            line[x] = qRgba((qRed(color) * a + 127) / 255, (qGreen(color) * a + 127) / 255,
+                            (qBlue(color) * a + 127) / 255, (qAlpha(color) * a + 127) / 255);
+        }
+    }
     return result;
 }
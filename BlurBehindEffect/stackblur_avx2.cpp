@@ -0,0 +1,143 @@
+#include "stackblur_p.h"
+
+#if defined(Q_PROCESSOR_X86)
+#include "stackblur_simd_p.h"
+#include <immintrin.h>
+
+namespace
+{
+    // Two lines at once: low 128-bit half holds the pixel of the
+    // first line, high half holds the pixel of the second one
+    struct Avx2
+    {
+        typedef __m256i type;
+        typedef __m128i raw;
+        struct mul_t
+        {
+            __m256i mul;
+            __m128i shr;
+        };
+        static constexpr unsigned int lanes = 2;
+        static constexpr unsigned int columnBlock = 4;
+
+        static inline type zero() { return _mm256_setzero_si256(); }
+        static inline type add(type a, type b) { return _mm256_add_epi32(a, b); }
+        static inline type sub(type a, type b) { return _mm256_sub_epi32(a, b); }
+
+        // both operands fit into 8 bits, so the 16-bit product is exact
+        static inline type mul(type v, unsigned int k) { return _mm256_mullo_epi16(v, _mm256_set1_epi32(int(k))); }
+
+        static inline mul_t multiplier(unsigned int mul_sum, unsigned int shr_sum)
+        {
+            return { _mm256_set1_epi32(int(mul_sum)), _mm_cvtsi32_si128(int(shr_sum)) };
+        }
+
+        static inline type scale(type v, const mul_t& m) { return _mm256_srl_epi32(_mm256_mullo_epi32(v, m.mul), m.shr); }
+
+        static inline __m128i loadRaw(const unsigned char* p, std::ptrdiff_t lineStep)
+        {
+            return _mm_unpacklo_epi32(_mm_cvtsi32_si128(load32(p)), _mm_cvtsi32_si128(load32(p + lineStep)));
+        }
+
+        static inline __m128i loadRawAdjacent(const unsigned char* p) { return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)); }
+        static inline __m128i loadStack(const unsigned char* s) { return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s)); }
+        static inline void storeStack(unsigned char* s, __m128i raw) { _mm_storel_epi64(reinterpret_cast<__m128i*>(s), raw); }
+        static inline type unpack(__m128i raw) { return _mm256_cvtepu8_epi32(raw); }
+
+        static inline void store(unsigned char* p, std::ptrdiff_t lineStep, type v, const unsigned char*)
+        {
+            const __m256i v16 = _mm256_packus_epi32(v, v);
+            const __m256i v8 = _mm256_packus_epi16(v16, v16);
+            store32(p, _mm_cvtsi128_si32(_mm256_castsi256_si128(v8)));
+            store32(p + lineStep, _mm_cvtsi128_si32(_mm256_extracti128_si256(v8, 1)));
+        }
+
+        static inline void storeAdjacent(unsigned char* p, type v, const unsigned char*)
+        {
+            // gather 16-bit values of both pixels into the low 128-bit half
+            const __m256i v16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+            const __m128i lo = _mm256_castsi256_si128(v16);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi16(lo, lo));
+        }
+    };
+
+    // Eight RGB32 lines at once, every 128-bit half spreads color values of
+    // 4 pixels over 3 vectors: [b0 g0 r0 b1] [g1 r1 b2 g2] [r2 b3 g3 r3],
+    // byte shuffles and packs of AVX2 never cross the halves
+    struct Avx2Rgb32
+    {
+        typedef __m256i raw;
+        static constexpr unsigned int lanes = 8;
+        static constexpr unsigned int columnBlock = 1;
+
+        static inline __m128i loadRaw4(const unsigned char* p, std::ptrdiff_t lineStep)
+        {
+            __m128i r = _mm_cvtsi32_si128(load32(p));
+            r = _mm_insert_epi32(r, load32(p + lineStep), 1);
+            r = _mm_insert_epi32(r, load32(p + 2 * lineStep), 2);
+            return _mm_insert_epi32(r, load32(p + 3 * lineStep), 3);
+        }
+
+        static inline void storeRaw4(unsigned char* p, std::ptrdiff_t lineStep, __m128i r)
+        {
+            store32(p, _mm_cvtsi128_si32(r));
+            store32(p + lineStep, _mm_extract_epi32(r, 1));
+            store32(p + 2 * lineStep, _mm_extract_epi32(r, 2));
+            store32(p + 3 * lineStep, _mm_extract_epi32(r, 3));
+        }
+
+        static inline raw loadRaw(const unsigned char* p, std::ptrdiff_t lineStep)
+        {
+            return _mm256_inserti128_si256(_mm256_castsi128_si256(loadRaw4(p, lineStep)), loadRaw4(p + 4 * lineStep, lineStep), 1);
+        }
+
+        static inline raw loadRawAdjacent(const unsigned char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+        static inline raw loadStack(const unsigned char* s) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)); }
+        static inline void storeStack(unsigned char* s, raw r) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(s), r); }
+
+        static inline void split(raw r, __m256i v[3])
+        {
+            v[0] = _mm256_shuffle_epi8(r, _mm256_setr_epi8(0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 4, -1, -1, -1,
+                                                           0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 4, -1, -1, -1));
+            v[1] = _mm256_shuffle_epi8(r, _mm256_setr_epi8(5, -1, -1, -1, 6, -1, -1, -1, 8, -1, -1, -1, 9, -1, -1, -1,
+                                                           5, -1, -1, -1, 6, -1, -1, -1, 8, -1, -1, -1, 9, -1, -1, -1));
+            v[2] = _mm256_shuffle_epi8(r, _mm256_setr_epi8(10, -1, -1, -1, 12, -1, -1, -1, 13, -1, -1, -1, 14, -1, -1, -1,
+                                                           10, -1, -1, -1, 12, -1, -1, -1, 13, -1, -1, -1, 14, -1, -1, -1));
+        }
+
+        static inline raw merge(const __m256i v[3], raw center)
+        {
+            const __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(v[0], v[1]), _mm256_packus_epi32(v[2], v[2]));
+            const __m256i colors = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                                                0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+            return _mm256_or_si256(colors, _mm256_and_si256(center, _mm256_set1_epi32(int(0xff000000))));
+        }
+
+        static inline void storeRaw(unsigned char* p, std::ptrdiff_t lineStep, raw r)
+        {
+            storeRaw4(p, lineStep, _mm256_castsi256_si128(r));
+            storeRaw4(p + 4 * lineStep, lineStep, _mm256_extracti128_si256(r, 1));
+        }
+
+        static inline void storeRawAdjacent(unsigned char* p, raw r) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), r); }
+    };
+}
+
+void stackblurJob_avx2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                       const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    stackblurJobSimd<Avx2>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+void stackblurJob_rgb32_avx2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    // two blocks of 8 columns do not fit into the AVX2 registers, while 16 columns
+    // of the SSE4.1 pass read whole cache lines and make the vertical pass faster
+    if (step == 2)
+        stackblurJob_rgb32_sse4(src, w, h, stride, radius, cores, core, step, stack);
+    else
+        stackblurJobSimd<StackBlurRgb32<Avx2, Avx2Rgb32>>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+#endif
@@ -0,0 +1,127 @@
+#pragma once
+#include <QtGlobal>
+#include <iterator>
+
+//
+// Internal stackblur kernel interface shared between the reference
+// implementation (stackblur.cpp) and the SIMD kernels (stackblur_*.cpp)
+//
+
+constexpr unsigned int minRadius() noexcept { return 2; }
+constexpr unsigned int maxRadius() noexcept { return 254; }
+
+inline constexpr unsigned short const stackblur_mul[] =
+{
+        512,512,456,512,328,456,335,512,405,328,271,456,388,335,292,512,
+        454,405,364,328,298,271,496,456,420,388,360,335,312,292,273,512,
+        482,454,428,405,383,364,345,328,312,298,284,271,259,496,475,456,
+        437,420,404,388,374,360,347,335,323,312,302,292,282,273,265,512,
+        497,482,468,454,441,428,417,405,394,383,373,364,354,345,337,328,
+        320,312,305,298,291,284,278,271,265,259,507,496,485,475,465,456,
+        446,437,428,420,412,404,396,388,381,374,367,360,354,347,341,335,
+        329,323,318,312,307,302,297,292,287,282,278,273,269,265,261,512,
+        505,497,489,482,475,468,461,454,447,441,435,428,422,417,411,405,
+        399,394,389,383,378,373,368,364,359,354,350,345,341,337,332,328,
+        324,320,316,312,309,305,301,298,294,291,287,284,281,278,274,271,
+        268,265,262,259,257,507,501,496,491,485,480,475,470,465,460,456,
+        451,446,442,437,433,428,424,420,416,412,408,404,400,396,392,388,
+        385,381,377,374,370,367,363,360,357,354,350,347,344,341,338,335,
+        332,329,326,323,320,318,315,312,310,307,304,302,299,297,294,292,
+        289,287,285,282,280,278,275,273,271,269,267,265,263,261,259
+};
+
+inline constexpr unsigned char const stackblur_shr[] =
+{
+        9, 11, 12, 13, 13, 14, 14, 15, 15, 15, 15, 16, 16, 16, 16, 17,
+        17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 18, 18, 19,
+        19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 20, 20, 20,
+        20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 21,
+        21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+        21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22,
+        22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+        22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 23,
+        23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+        23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+        23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+        23, 23, 23, 23, 23, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+        24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+        24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+        24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+        24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24
+};
+
+inline constexpr auto precomputedArraySize = 255;
+static_assert(std::size(stackblur_mul) == precomputedArraySize);
+static_assert(std::size(stackblur_shr) == precomputedArraySize);
+
+// For every radius in range (255 * (radius + 1)^2 * stackblur_mul[radius]) < 2^32,
+// so 32-bit vector lanes produce exactly the same result as the scalar code
+
+
+/// Stackblur pass function, see stackblurJob() for the parameters description
+typedef void (*StackBlurJob)(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core,
+                             const int step, unsigned char* stack);
+
+/// Available stackblur kernel implementations
+enum class StackBlurKernel
+{
+    Scalar, ///< portable reference implementation
+    SSE2,   ///< one line per register, 4 channels in a single 128-bit register
+    SSE41,  ///< same as SSE2 with native 32-bit multiplication
+    AVX2    ///< two lines per register in a single 256-bit register
+};
+
+/// Maximum number of lines processed simultaneously by any kernel
+constexpr unsigned int stackblurMaxLines() noexcept { return 16; }
+
+/// Stack buffer size (in bytes) required by a single working thread
+constexpr unsigned int stackblurStackSize(unsigned int radius) noexcept { return (radius * 2 + 1) * 4 * stackblurMaxLines(); }
+
+/// Returns true if kernel is compiled in and supported by the running CPU
+bool stackblurKernelSupported(StackBlurKernel kernel);
+
+/// Returns the fastest kernel supported by the running CPU
+StackBlurKernel stackblurBestKernel();
+
+/// Returns pass function of the kernel or nullptr if kernel is not supported
+StackBlurJob stackblurKernelJob(StackBlurKernel kernel);
+
+/// Returns 3 channel pass of opaque RGB32 images of the kernel, which leaves
+/// alpha bytes untouched, or nullptr if kernel is not supported
+StackBlurJob stackblurKernelJob_rgb32(StackBlurKernel kernel);
+
+/// Reference stackblur pass
+void stackblurJob(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                  const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+
+/// Stackblur pass of single channel 8-bit images (Alpha8, Grayscale8)
+void stackblurJob_a8(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                     const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+
+/// Stackblur pass of opaque RGB32 images, alpha bytes are left untouched
+void stackblurJob_rgb32(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                        const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+
+#if defined(Q_PROCESSOR_X86)
+void stackblurJob_sse2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                       const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+void stackblurJob_sse4(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                       const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+void stackblurJob_avx2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                       const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+void stackblurJob_rgb32_sse2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+void stackblurJob_rgb32_sse4(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+void stackblurJob_rgb32_avx2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack);
+#endif
+
+/// Blurs w x h ARGB32 buffer with stride bytes per scanline in place using specified kernel
+void stackblur(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+               const unsigned int radius, const int coreCount, StackBlurKernel kernel);
+
+/// Blurs w x h buffer in place using specified pass function, which defines the pixel layout
+void stackblur(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+               const unsigned int radius, const int coreCount, StackBlurJob job);
@@ -0,0 +1,271 @@
+#pragma once
+#include "stackblur_p.h"
+#include <cstddef>
+#include <cstring>
+#include <emmintrin.h>
+
+//
+// Generic vectorized stackblur line kernel.
+//
+// Every stackblur_<isa>.cpp translation unit defines its own (anonymous)
+// vector traits type V and instantiates stackblurJobSimd<V>() with it.
+// V keeps all 4 channels of V::lanes pixels in 32-bit lanes of a single
+// register (or the color channels only, see StackBlurRgb32) and must provide:
+//
+//   typedef ... type;                                   vector of V::lanes unpacked pixels
+//   typedef ... raw;                                    V::lanes packed pixels
+//   static constexpr unsigned int lanes;                number of lines processed at once
+//   static constexpr unsigned int columnBlock;          vectors per block in the vertical pass
+//   static type zero();
+//   static type add(type, type);
+//   static type sub(type, type);
+//   static type mul(type, unsigned int k);              k < 256
+//   static mul_t multiplier(unsigned int mul_sum, unsigned int shr_sum);
+//   static type scale(type, const mul_t&);              (v * mul_sum) >> shr_sum
+//   static raw loadRaw(const unsigned char* p, std::ptrdiff_t lineStep);    packed pixels of all lines
+//   static raw loadRawAdjacent(const unsigned char* p);                      same for lineStep == 4
+//   static void storeStack(unsigned char* s, raw);
+//   static raw loadStack(const unsigned char* s);
+//   static type unpack(raw);
+//   static void store(unsigned char* p, std::ptrdiff_t lineStep, type, const unsigned char* center);
+//   static void storeAdjacent(unsigned char* p, type, const unsigned char* center); same for lineStep == 4
+//
+// Pixel of line k is located at (p + k * lineStep), lineStep == 0 makes all
+// lanes process the same line which is used to handle the remaining lines.
+// center is the stack entry of the stored source pixels, a kernel that
+// leaves some bytes of the pixels untouched takes them from there.
+//
+
+namespace
+{
+    inline int load32(const unsigned char* p)
+    {
+        int v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline void store32(unsigned char* p, int v)
+    {
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    /// Loads pixels of vector k of the block
+    template<class V, bool Adjacent>
+    inline typename V::raw loadBlock(const unsigned char* p, std::ptrdiff_t lineStep, unsigned int k)
+    {
+        if (Adjacent)
+            return V::loadRawAdjacent(p + 4 * V::lanes * k);
+        return V::loadRaw(p + V::lanes * lineStep * k, lineStep);
+    }
+
+    /// Stores pixels of vector k of the block
+    template<class V, bool Adjacent>
+    inline void storeBlock(unsigned char* p, std::ptrdiff_t lineStep, unsigned int k, typename V::type v, const unsigned char* center)
+    {
+        if (Adjacent)
+            V::storeAdjacent(p + 4 * V::lanes * k, v, center);
+        else
+            V::store(p + V::lanes * lineStep * k, lineStep, v, center);
+    }
+
+    /// Blurs N * V::lanes lines of len pixels starting at src.
+    /// Adjacent lines are neighbour columns, so every step of the
+    /// vertical pass reads and writes a contiguous run of 4 * V::lanes * N bytes.
+    template<class V, unsigned int N, bool Adjacent>
+    void stackblurLines(unsigned char* src,            ///< first pixel of the first line
+                        const unsigned int len,        ///< line length in pixels
+                        const std::ptrdiff_t step,     ///< distance between adjacent pixels of a line
+                        const std::ptrdiff_t lineStep, ///< distance between adjacent lines (4 if Adjacent)
+                        const unsigned int radius,
+                        const typename V::mul_t& mul_sum,
+                        unsigned char* stack)
+    {
+        typedef typename V::type vec;
+        constexpr unsigned int vecEntry = 4 * V::lanes;
+        constexpr unsigned int entry = vecEntry * N;
+
+        const unsigned int lm = len - 1;
+        const unsigned int div = (radius * 2) + 1;
+
+        vec sum[N];
+        vec sum_in[N];
+        vec sum_out[N];
+        for (unsigned int k = 0; k < N; ++k)
+            sum[k] = sum_in[k] = sum_out[k] = V::zero();
+
+        unsigned char* src_ptr = src;
+        unsigned char* stack_ptr;
+
+        for(unsigned int i = 0; i <= radius; i++)
+        {
+            stack_ptr = &stack[entry * i];
+            for (unsigned int k = 0; k < N; ++k)
+            {
+                const typename V::raw raw = loadBlock<V, Adjacent>(src_ptr, lineStep, k);
+                V::storeStack(stack_ptr + vecEntry * k, raw);
+                const vec px = V::unpack(raw);
+                sum[k] = V::add(sum[k], V::mul(px, i + 1));
+                sum_out[k] = V::add(sum_out[k], px);
+            }
+        }
+
+        for(unsigned int i = 1; i <= radius; i++)
+        {
+            if (i <= lm) src_ptr += step;
+            stack_ptr = &stack[entry * (i + radius)];
+            for (unsigned int k = 0; k < N; ++k)
+            {
+                const typename V::raw raw = loadBlock<V, Adjacent>(src_ptr, lineStep, k);
+                V::storeStack(stack_ptr + vecEntry * k, raw);
+                const vec px = V::unpack(raw);
+                sum[k] = V::add(sum[k], V::mul(px, radius + 1 - i));
+                sum_in[k] = V::add(sum_in[k], px);
+            }
+        }
+
+        unsigned int sp = radius;
+        unsigned int xp = radius;
+        if (xp > lm) xp = lm;
+        src_ptr = src + xp * step;
+        unsigned char* dst_ptr = src;
+        for(unsigned int x = 0; x < len; x++)
+        {
+            unsigned int stack_start = sp + div - radius;
+            if (stack_start >= div) stack_start -= div;
+            stack_ptr = &stack[entry * stack_start];
+
+            if(xp < lm)
+            {
+                src_ptr += step;
+                ++xp;
+            }
+
+            const unsigned char* center_ptr = &stack[entry * sp];
+            ++sp;
+            if (sp >= div) sp = 0;
+            const unsigned char* next_ptr = &stack[entry * sp];
+
+            for (unsigned int k = 0; k < N; ++k)
+            {
+                storeBlock<V, Adjacent>(dst_ptr, lineStep, k, V::scale(sum[k], mul_sum), center_ptr + vecEntry * k);
+
+                sum[k] = V::sub(sum[k], sum_out[k]);
+                sum_out[k] = V::sub(sum_out[k], V::unpack(V::loadStack(stack_ptr + vecEntry * k)));
+
+                const typename V::raw raw = loadBlock<V, Adjacent>(src_ptr, lineStep, k);
+                V::storeStack(stack_ptr + vecEntry * k, raw);
+
+                sum_in[k] = V::add(sum_in[k], V::unpack(raw));
+                sum[k] = V::add(sum[k], sum_in[k]);
+
+                const vec px = V::unpack(V::loadStack(next_ptr + vecEntry * k));
+                sum_out[k] = V::add(sum_out[k], px);
+                sum_in[k] = V::sub(sum_in[k], px);
+            }
+
+            dst_ptr += step;
+        }
+    }
+
+    /// Vector traits of the 3 channel pass of opaque RGB32 pixels, built on the
+    /// 4 channel traits V of the same instruction set. Color values of P::lanes
+    /// pixels fill 3 vectors of V instead of 4, so every pixel costs 3/4 of the
+    /// arithmetic, alpha bytes are copied from the source pixel. P provides the
+    /// packed pixel access of the instruction set:
+    ///
+    ///   typedef ... raw;                                 P::lanes packed pixels, one V::type wide
+    ///   static constexpr unsigned int lanes;
+    ///   static constexpr unsigned int columnBlock;
+    ///   loadRaw(), loadRawAdjacent(), loadStack(), storeStack() as described above
+    ///   static void split(raw, typename V::type v[3]);  color values, 32-bit each
+    ///   static raw merge(const typename V::type v[3], raw center); packs them back, alpha of center
+    ///   static void storeRaw(unsigned char* p, std::ptrdiff_t lineStep, raw);
+    ///   static void storeRawAdjacent(unsigned char* p, raw);
+    ///
+    /// Lanes are not tied to channels in split vectors, the blur treats every
+    /// 32-bit lane in the same way, so only split() and merge() care about the order.
+    template<class V, class P>
+    struct StackBlurRgb32
+    {
+        typedef typename P::raw raw;
+        typedef typename V::mul_t mul_t;
+        struct type
+        {
+            typename V::type v[3];
+        };
+        static constexpr unsigned int lanes = P::lanes;
+        static constexpr unsigned int columnBlock = P::columnBlock;
+
+        static inline type zero() { return { { V::zero(), V::zero(), V::zero() } }; }
+        static inline type add(type a, type b) { return { { V::add(a.v[0], b.v[0]), V::add(a.v[1], b.v[1]), V::add(a.v[2], b.v[2]) } }; }
+        static inline type sub(type a, type b) { return { { V::sub(a.v[0], b.v[0]), V::sub(a.v[1], b.v[1]), V::sub(a.v[2], b.v[2]) } }; }
+        static inline type mul(type a, unsigned int k) { return { { V::mul(a.v[0], k), V::mul(a.v[1], k), V::mul(a.v[2], k) } }; }
+        static inline mul_t multiplier(unsigned int mul_sum, unsigned int shr_sum) { return V::multiplier(mul_sum, shr_sum); }
+        static inline type scale(type a, const mul_t& m) { return { { V::scale(a.v[0], m), V::scale(a.v[1], m), V::scale(a.v[2], m) } }; }
+
+        static inline raw loadRaw(const unsigned char* p, std::ptrdiff_t lineStep) { return P::loadRaw(p, lineStep); }
+        static inline raw loadRawAdjacent(const unsigned char* p) { return P::loadRawAdjacent(p); }
+        static inline raw loadStack(const unsigned char* s) { return P::loadStack(s); }
+        static inline void storeStack(unsigned char* s, raw r) { P::storeStack(s, r); }
+
+        static inline type unpack(raw r)
+        {
+            type t;
+            P::split(r, t.v);
+            return t;
+        }
+
+        static inline void store(unsigned char* p, std::ptrdiff_t lineStep, type t, const unsigned char* center)
+        {
+            P::storeRaw(p, lineStep, P::merge(t.v, P::loadStack(center)));
+        }
+
+        static inline void storeAdjacent(unsigned char* p, type t, const unsigned char* center)
+        {
+            P::storeRawAdjacent(p, P::merge(t.v, P::loadStack(center)));
+        }
+    };
+
+    /// Vectorized counterpart of stackblurJob()
+    template<class V>
+    void stackblurJobSimd(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                          const unsigned int radius, const int cores, const int core,
+                          const int step, unsigned char* stack)
+    {
+        static_assert(V::lanes * V::columnBlock <= stackblurMaxLines(), "stack buffer is too small");
+
+        const typename V::mul_t mul_sum = V::multiplier(stackblur_mul[radius], stackblur_shr[radius]);
+        const std::ptrdiff_t bpl = stride;
+
+        if (step == 1)
+        {
+            const unsigned int minY = core * h / cores;
+            const unsigned int maxY = (core + 1) * h / cores;
+
+            unsigned int y = minY;
+            for(; y + V::lanes <= maxY; y += V::lanes)
+                stackblurLines<V, 1, false>(src + bpl * y, w, 4, bpl, radius, mul_sum, stack);
+            for(; y < maxY; y++)
+                stackblurLines<V, 1, false>(src + bpl * y, w, 4, 0, radius, mul_sum, stack);
+        }
+
+        if (step == 2)
+        {
+            // walking a single column with scanline stride touches a new cache line
+            // on every row, so process blocks of adjacent columns instead
+            constexpr unsigned int block = V::lanes * V::columnBlock;
+
+            const unsigned int minX = core * w / cores;
+            const unsigned int maxX = (core + 1) * w / cores;
+
+            unsigned int x = minX;
+            for(; x + block <= maxX; x += block)
+                stackblurLines<V, V::columnBlock, true>(src + 4 * x, h, bpl, 4, radius, mul_sum, stack);
+            for(; x + V::lanes <= maxX; x += V::lanes)
+                stackblurLines<V, 1, true>(src + 4 * x, h, bpl, 4, radius, mul_sum, stack);
+            for(; x < maxX; x++)
+                stackblurLines<V, 1, false>(src + 4 * x, h, bpl, 0, radius, mul_sum, stack);
+        }
+    }
+}
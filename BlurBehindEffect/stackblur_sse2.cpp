@@ -0,0 +1,134 @@
+#include "stackblur_p.h"
+
+#if defined(Q_PROCESSOR_X86)
+#include "stackblur_simd_p.h"
+#include <emmintrin.h>
+
+namespace
+{
+    struct Sse2
+    {
+        typedef __m128i type;
+        typedef __m128i raw;
+        struct mul_t
+        {
+            __m128i mul;
+            __m128i shr;
+        };
+        static constexpr unsigned int lanes = 1;
+        static constexpr unsigned int columnBlock = 8;
+
+        static inline type zero() { return _mm_setzero_si128(); }
+        static inline type add(type a, type b) { return _mm_add_epi32(a, b); }
+        static inline type sub(type a, type b) { return _mm_sub_epi32(a, b); }
+
+        // both operands fit into 8 bits, so the 16-bit product is exact
+        static inline type mul(type v, unsigned int k) { return _mm_mullo_epi16(v, _mm_set1_epi32(int(k))); }
+
+        static inline mul_t multiplier(unsigned int mul_sum, unsigned int shr_sum)
+        {
+            return { _mm_set1_epi32(int(mul_sum)), _mm_cvtsi32_si128(int(shr_sum)) };
+        }
+
+        // SSE2 has no 32-bit multiplication, multiply even and odd lanes
+        // into 64-bit products, which never exceed 32 bits after the shift
+        static inline type scale(type v, const mul_t& m)
+        {
+            const __m128i even = _mm_srl_epi64(_mm_mul_epu32(v, m.mul), m.shr);
+            const __m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), m.mul), m.shr);
+            return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+        }
+
+        static inline __m128i loadRaw(const unsigned char* p, std::ptrdiff_t) { return _mm_cvtsi32_si128(load32(p)); }
+        static inline __m128i loadRawAdjacent(const unsigned char* p) { return loadRaw(p, 4); }
+        static inline __m128i loadStack(const unsigned char* s) { return _mm_cvtsi32_si128(load32(s)); }
+        static inline void storeStack(unsigned char* s, __m128i raw) { store32(s, _mm_cvtsi128_si32(raw)); }
+
+        static inline type unpack(__m128i raw)
+        {
+            const __m128i z = _mm_setzero_si128();
+            return _mm_unpacklo_epi16(_mm_unpacklo_epi8(raw, z), z);
+        }
+
+        static inline void store(unsigned char* p, std::ptrdiff_t, type v, const unsigned char*)
+        {
+            const __m128i v16 = _mm_packs_epi32(v, v);
+            store32(p, _mm_cvtsi128_si32(_mm_packus_epi16(v16, v16)));
+        }
+
+        static inline void storeAdjacent(unsigned char* p, type v, const unsigned char* center) { store(p, 4, v, center); }
+    };
+
+    // Four RGB32 lines at once, color values of the pixels are
+    // spread over 3 vectors: [b0 g0 r0 b1] [g1 r1 b2 g2] [r2 b3 g3 r3]
+    struct Sse2Rgb32
+    {
+        typedef __m128i raw;
+        static constexpr unsigned int lanes = 4;
+        // 16 columns of the vertical pass use whole 64-byte cache lines
+        static constexpr unsigned int columnBlock = 4;
+
+        static inline raw loadRaw(const unsigned char* p, std::ptrdiff_t lineStep)
+        {
+            const __m128i p01 = _mm_unpacklo_epi32(_mm_cvtsi32_si128(load32(p)), _mm_cvtsi32_si128(load32(p + lineStep)));
+            const __m128i p23 = _mm_unpacklo_epi32(_mm_cvtsi32_si128(load32(p + 2 * lineStep)), _mm_cvtsi32_si128(load32(p + 3 * lineStep)));
+            return _mm_unpacklo_epi64(p01, p23);
+        }
+
+        static inline raw loadRawAdjacent(const unsigned char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+        static inline raw loadStack(const unsigned char* s) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)); }
+        static inline void storeStack(unsigned char* s, raw r) { _mm_storeu_si128(reinterpret_cast<__m128i*>(s), r); }
+
+        // no byte shuffle in SSE2, pixels are unpacked as usual and
+        // the alpha lanes are filled with the next pixel colors
+        static inline void split(raw r, __m128i v[3])
+        {
+            const __m128i z = _mm_setzero_si128();
+            const __m128i lo = _mm_unpacklo_epi8(r, z);
+            const __m128i hi = _mm_unpackhi_epi8(r, z);
+            const __m128i p0 = _mm_unpacklo_epi16(lo, z);
+            const __m128i p1 = _mm_unpackhi_epi16(lo, z);
+            const __m128i p2 = _mm_unpacklo_epi16(hi, z);
+            const __m128i p3 = _mm_unpackhi_epi16(hi, z);
+            v[0] = _mm_or_si128(_mm_and_si128(p0, _mm_setr_epi32(-1, -1, -1, 0)), _mm_slli_si128(p1, 12));
+            v[1] = _mm_unpacklo_epi64(_mm_srli_si128(p1, 4), p2);
+            v[2] = _mm_castps_si128(_mm_move_ss(_mm_castsi128_ps(_mm_slli_si128(p3, 4)), _mm_castsi128_ps(_mm_srli_si128(p2, 8))));
+        }
+
+        static inline raw merge(const __m128i v[3], raw center)
+        {
+            // alpha lanes of p0..p3 hold color values, they are masked out below
+            const __m128i p0 = v[0];
+            const __m128i p1 = _mm_or_si128(_mm_srli_si128(v[0], 12), _mm_slli_si128(v[1], 4));
+            const __m128i p2 = _mm_or_si128(_mm_srli_si128(v[1], 8), _mm_slli_si128(v[2], 8));
+            const __m128i p3 = _mm_srli_si128(v[2], 4);
+            const __m128i colors = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+            const __m128i alpha = _mm_set1_epi32(int(0xff000000));
+            return _mm_or_si128(_mm_andnot_si128(alpha, colors), _mm_and_si128(alpha, center));
+        }
+
+        static inline void storeRaw(unsigned char* p, std::ptrdiff_t lineStep, raw r)
+        {
+            store32(p, _mm_cvtsi128_si32(r));
+            store32(p + lineStep, _mm_cvtsi128_si32(_mm_srli_si128(r, 4)));
+            store32(p + 2 * lineStep, _mm_cvtsi128_si32(_mm_srli_si128(r, 8)));
+            store32(p + 3 * lineStep, _mm_cvtsi128_si32(_mm_srli_si128(r, 12)));
+        }
+
+        static inline void storeRawAdjacent(unsigned char* p, raw r) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), r); }
+    };
+}
+
+void stackblurJob_sse2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                       const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    stackblurJobSimd<Sse2>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+void stackblurJob_rgb32_sse2(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    stackblurJobSimd<StackBlurRgb32<Sse2, Sse2Rgb32>>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#include "stackblur_p.h"
+
+#if defined(Q_PROCESSOR_X86)
+#include "stackblur_simd_p.h"
+#include <smmintrin.h>
+
+namespace
+{
+    struct Sse41
+    {
+        typedef __m128i type;
+        typedef __m128i raw;
+        struct mul_t
+        {
+            __m128i mul;
+            __m128i shr;
+        };
+        static constexpr unsigned int lanes = 1;
+        static constexpr unsigned int columnBlock = 8;
+
+        static inline type zero() { return _mm_setzero_si128(); }
+        static inline type add(type a, type b) { return _mm_add_epi32(a, b); }
+        static inline type sub(type a, type b) { return _mm_sub_epi32(a, b); }
+
+        // both operands fit into 8 bits, so the 16-bit product is exact
+        static inline type mul(type v, unsigned int k) { return _mm_mullo_epi16(v, _mm_set1_epi32(int(k))); }
+
+        static inline mul_t multiplier(unsigned int mul_sum, unsigned int shr_sum)
+        {
+            return { _mm_set1_epi32(int(mul_sum)), _mm_cvtsi32_si128(int(shr_sum)) };
+        }
+
+        static inline type scale(type v, const mul_t& m) { return _mm_srl_epi32(_mm_mullo_epi32(v, m.mul), m.shr); }
+
+        static inline __m128i loadRaw(const unsigned char* p, std::ptrdiff_t) { return _mm_cvtsi32_si128(load32(p)); }
+        static inline __m128i loadRawAdjacent(const unsigned char* p) { return loadRaw(p, 4); }
+        static inline __m128i loadStack(const unsigned char* s) { return _mm_cvtsi32_si128(load32(s)); }
+        static inline void storeStack(unsigned char* s, __m128i raw) { store32(s, _mm_cvtsi128_si32(raw)); }
+        static inline type unpack(__m128i raw) { return _mm_cvtepu8_epi32(raw); }
+
+        static inline void store(unsigned char* p, std::ptrdiff_t, type v, const unsigned char*)
+        {
+            const __m128i v16 = _mm_packus_epi32(v, v);
+            store32(p, _mm_cvtsi128_si32(_mm_packus_epi16(v16, v16)));
+        }
+
+        static inline void storeAdjacent(unsigned char* p, type v, const unsigned char* center) { store(p, 4, v, center); }
+    };
+
+    // Four RGB32 lines at once, color values of the pixels are
+    // spread over 3 vectors: [b0 g0 r0 b1] [g1 r1 b2 g2] [r2 b3 g3 r3]
+    struct Sse41Rgb32
+    {
+        typedef __m128i raw;
+        static constexpr unsigned int lanes = 4;
+        // 16 columns of the vertical pass use whole 64-byte cache lines
+        static constexpr unsigned int columnBlock = 4;
+
+        static inline raw loadRaw(const unsigned char* p, std::ptrdiff_t lineStep)
+        {
+            __m128i r = _mm_cvtsi32_si128(load32(p));
+            r = _mm_insert_epi32(r, load32(p + lineStep), 1);
+            r = _mm_insert_epi32(r, load32(p + 2 * lineStep), 2);
+            return _mm_insert_epi32(r, load32(p + 3 * lineStep), 3);
+        }
+
+        static inline raw loadRawAdjacent(const unsigned char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+        static inline raw loadStack(const unsigned char* s) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)); }
+        static inline void storeStack(unsigned char* s, raw r) { _mm_storeu_si128(reinterpret_cast<__m128i*>(s), r); }
+
+        static inline void split(raw r, __m128i v[3])
+        {
+            v[0] = _mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 4, -1, -1, -1));
+            v[1] = _mm_shuffle_epi8(r, _mm_setr_epi8(5, -1, -1, -1, 6, -1, -1, -1, 8, -1, -1, -1, 9, -1, -1, -1));
+            v[2] = _mm_shuffle_epi8(r, _mm_setr_epi8(10, -1, -1, -1, 12, -1, -1, -1, 13, -1, -1, -1, 14, -1, -1, -1));
+        }
+
+        static inline raw merge(const __m128i v[3], raw center)
+        {
+            // 12 color bytes in a row, then moved back next to their alpha bytes
+            const __m128i packed = _mm_packus_epi16(_mm_packus_epi32(v[0], v[1]), _mm_packus_epi32(v[2], v[2]));
+            const __m128i colors = _mm_shuffle_epi8(packed, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+            return _mm_or_si128(colors, _mm_and_si128(center, _mm_set1_epi32(int(0xff000000))));
+        }
+
+        static inline void storeRaw(unsigned char* p, std::ptrdiff_t lineStep, raw r)
+        {
+            store32(p, _mm_cvtsi128_si32(r));
+            store32(p + lineStep, _mm_extract_epi32(r, 1));
+            store32(p + 2 * lineStep, _mm_extract_epi32(r, 2));
+            store32(p + 3 * lineStep, _mm_extract_epi32(r, 3));
+        }
+
+        static inline void storeRawAdjacent(unsigned char* p, raw r) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), r); }
+    };
+}
+
+void stackblurJob_sse4(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                       const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    stackblurJobSimd<Sse41>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+void stackblurJob_rgb32_sse4(unsigned char* src, const unsigned int w, const unsigned int h, const unsigned int stride,
+                             const unsigned int radius, const int cores, const int core, const int step, unsigned char* stack)
+{
+    stackblurJobSimd<StackBlurRgb32<Sse41, Sse41Rgb32>>(src, w, h, stride, radius, cores, core, step, stack);
+}
+
+#endif
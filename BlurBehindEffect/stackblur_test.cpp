@@ -0,0 +1,138 @@
+#include "stackblur_p.h"
+#include "blur.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <QtGlobal>
+
+//
+// Stackblur kernel equality test.
+//
+// Every SIMD kernel supported by the running CPU must produce exactly the
+// output of the scalar reference kernel, for any size (including the
+// remainder lines and columns of the vector blocks), radius, stride and
+// thread count. The same holds for the 3 channel RGB32 passes, which must
+// leave alpha bytes untouched. A plan patching the rects of a dirty region
+// must produce the blur of the whole changed image. Returns non-zero on the
+// first mismatch.
+//
+
+namespace
+{
+    struct Kernel
+    {
+        const char* name;
+        StackBlurKernel kernel;
+    };
+
+    std::vector<unsigned char> randomImage(unsigned int _stride, unsigned int _height, unsigned int _seed)
+    {
+        std::mt19937 random(_seed);
+        std::vector<unsigned char> image(_stride * _height);
+        for (auto& v : image)
+            v = static_cast<unsigned char>(random());
+        return image;
+    }
+}
+
+int main()
+{
+    const Kernel kernels[] = {
+        { "sse2", StackBlurKernel::SSE2 },
+        { "sse41", StackBlurKernel::SSE41 },
+        { "avx2", StackBlurKernel::AVX2 },
+    };
+    const unsigned int sizes[][2] = { { 1, 1 }, { 1, 37 }, { 37, 1 }, { 7, 9 }, { 16, 16 }, { 67, 45 }, { 300, 17 } };
+    const unsigned int radii[] = { 2, 3, 7, 25, 254 };
+    const int threadCounts[] = { 1, 3 };
+
+    int checked = 0;
+    for (const auto& k : kernels)
+    {
+        if (!stackblurKernelSupported(k.kernel))
+        {
+            qWarning("%s: not supported, skipped", k.name);
+            continue;
+        }
+
+        for (const auto& size : sizes)
+        {
+            const unsigned int w = size[0];
+            const unsigned int h = size[1];
+            // padded stride makes sure no kernel writes past the line end
+            const unsigned int stride = w * 4 + 12;
+            for (auto radius : radii)
+            {
+                for (auto threads : threadCounts)
+                {
+                    const auto source = randomImage(stride, h, w * 1000 + h + radius);
+                    auto expected = source;
+                    auto actual = source;
+                    stackblur(expected.data(), w, h, stride, radius, threads, StackBlurKernel::Scalar);
+                    stackblur(actual.data(), w, h, stride, radius, threads, k.kernel);
+                    if (actual != expected)
+                    {
+                        qWarning("%s: %ux%u radius %u threads %d differs from scalar", k.name, w, h, radius, threads);
+                        return 1;
+                    }
+
+                    // random alpha bytes show whether the pass leaves them untouched
+                    auto expectedRgb = source;
+                    auto actualRgb = source;
+                    stackblur(expectedRgb.data(), w, h, stride, radius, threads, stackblurKernelJob_rgb32(StackBlurKernel::Scalar));
+                    stackblur(actualRgb.data(), w, h, stride, radius, threads, stackblurKernelJob_rgb32(k.kernel));
+                    if (actualRgb != expectedRgb)
+                    {
+                        qWarning("%s: rgb32 %ux%u radius %u threads %d differs from scalar", k.name, w, h, radius, threads);
+                        return 1;
+                    }
+                    checked += 2;
+                }
+            }
+        }
+    }
+
+    qWarning("%d kernel runs match the scalar kernel", checked);
+
+    // distant changes are patched apart, close ones together, large ones fall back to the full blur
+    const QRect changes[][3] = {
+        { QRect(5, 5, 10, 8), QRect(250, 150, 20, 30), QRect(140, 90, 1, 1) },
+        { QRect(100, 50, 4, 4), QRect(110, 58, 6, 3), QRect(0, 199, 300, 1) },
+        { QRect(0, 0, 300, 120), QRect(20, 150, 5, 5), QRect(299, 0, 1, 200) },
+    };
+    const int w = 300;
+    const int h = 200;
+    for (unsigned int radius : { 2u, 6u, 40u })
+    {
+        BlurPlan plan(QSize(w, h), int(radius));
+        for (const auto& rects : changes)
+        {
+            auto before = randomImage(w * 4, h, radius);
+            auto after = before;
+            QRegion dirty;
+            for (const QRect& rect : rects)
+            {
+                const auto pixels = randomImage(rect.width() * 4, rect.height(), radius + 1);
+                for (int y = 0; y < rect.height(); ++y)
+                    std::copy_n(pixels.data() + y * rect.width() * 4, rect.width() * 4, after.data() + (rect.y() + y) * w * 4 + rect.x() * 4);
+                dirty |= rect;
+            }
+
+            std::vector<unsigned char> patched(before.size());
+            std::vector<unsigned char> expected(before.size());
+            const auto view = [&](std::vector<unsigned char>& _pixels) {
+                return BlurImageRef(_pixels.data(), w, h, w * 4, QImage::Format_ARGB32_Premultiplied);
+            };
+            plan.execute(view(before), view(patched));
+            plan.execute(view(after), view(patched), dirty);
+            plan.execute(view(after), view(expected));
+            if (patched != expected)
+            {
+                qWarning("plan patch of %d rects radius %u differs from the full blur", dirty.rectCount(), radius);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
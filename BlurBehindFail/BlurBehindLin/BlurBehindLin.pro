@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-CONFIG += c++1z
+CONFIG += c++1z simd
 
 QT       += core gui x11extras
 
@@ -34,11 +34,21 @@ SOURCES += \
     windowfunctions.cpp \
     xcbwindowmanager.cpp \
     ../../BlurBehindEffect/boxblur.cpp \
-    ../../BlurBehindEffect/stackblur.cpp
+    ../../BlurBehindEffect/downsample.cpp \
+    ../../BlurBehindEffect/kawaseblur.cpp \
+    ../../BlurBehindEffect/stackblur.cpp \
+    ../../BlurBehindEffect/blurplan.cpp
 
 HEADERS += \
     widget.h \
     windowfunctions.h \
     xcbwindowmanager.h \
-    blur.h
+    blur.h \
+    ../../BlurBehindEffect/blurparallel_p.h \
+    ../../BlurBehindEffect/stackblur_p.h \
+    ../../BlurBehindEffect/stackblur_simd_p.h
+
+SSE2_SOURCES += ../../BlurBehindEffect/stackblur_sse2.cpp
+SSE4_1_SOURCES += ../../BlurBehindEffect/stackblur_sse4.cpp
+AVX2_SOURCES += ../../BlurBehindEffect/stackblur_avx2.cpp
 
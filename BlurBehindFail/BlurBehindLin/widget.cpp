@@ -54,7 +54,10 @@ public:
     {
         const QSize size = pixmap.size();
         const QSize scaledSize = (QSizeF(size) * 0.25).toSize();
-        QPixmap p = QPixmap::fromImage(stackBlurImage(pixmap.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation), 3, 2));
+        // scaled frame is not shared, blur it in place instead of copying
+        QImage frame = pixmap.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        stackBlur(BlurImageRef(frame), 3, 2);
+        QPixmap p = QPixmap::fromImage(frame);
         return p.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
     }
 
@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-CONFIG += c++1z
+CONFIG += c++1z simd
 QT       += core gui
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
@@ -26,8 +26,12 @@ DEFINES += QT_DEPRECATED_WARNINGS
 SOURCES += \
     ../BlurBehindEffect/blurbehindeffect.cpp \
     ../BlurBehindEffect/glblurfunctions.cpp \
+    ../BlurBehindEffect/glblurservice.cpp \
     ../BlurBehindEffect/boxblur.cpp \
+    ../BlurBehindEffect/downsample.cpp \
+    ../BlurBehindEffect/kawaseblur.cpp \
     ../BlurBehindEffect/stackblur.cpp \
+    ../BlurBehindEffect/blurplan.cpp \
     ../ShapedWidget/shapedwidget.cpp \
     ../CustomButton/custombutton.cpp \
     ../MultiLayerWindow/contentwidget.cpp \
@@ -43,8 +47,12 @@ SOURCES += \
 HEADERS += \
     ../BlurBehindEffect/blurbehindeffect.h \
     ../BlurBehindEffect/glblurfunctions.h \
+    ../BlurBehindEffect/glblurservice_p.h \
     ../BlurBehindEffect/boxblur.h \
     ../BlurBehindEffect/stackblur.h \
+    ../BlurBehindEffect/blurparallel_p.h \
+    ../BlurBehindEffect/stackblur_p.h \
+    ../BlurBehindEffect/stackblur_simd_p.h \
     ../BlurBehindEffect/vertex.h \
     ../ShapedWidget/shapedwidget.h \
     ../CustomButton/custombutton.h \
@@ -57,6 +65,9 @@ HEADERS += \
     overlaypanel.h \
     mainwindow.h
 
+SSE2_SOURCES += ../BlurBehindEffect/stackblur_sse2.cpp
+SSE4_1_SOURCES += ../BlurBehindEffect/stackblur_sse4.cpp
+AVX2_SOURCES += ../BlurBehindEffect/stackblur_avx2.cpp
 
 RESOURCES += \
     resources.qrc
@@ -122,6 +122,10 @@ MainWindow::MainWindow(QWidget* _parent)
     messagesLayer_->hide();
     warningsLayer_->hide();
 
+    // only the panels are blurred, the effect packs them into a small atlas
+    for (QWidget* panel : { static_cast<QWidget*>(controlPanel_), static_cast<QWidget*>(messagePanel_), static_cast<QWidget*>(warningPanel_) })
+        panel->installEventFilter(this);
+
     setMinimumHeight(kMinimumHeight);
 }
 
@@ -198,7 +202,34 @@ void MainWindow::clearImage()
 void MainWindow::resizeEvent(QResizeEvent *_event)
 {
     QWidget::resizeEvent(_event);
-    effect_->setRegion(rect());
+    updateBlurRegion();
+}
+
+bool MainWindow::eventFilter(QObject* _watched, QEvent* _event)
+{
+    switch (_event->type())
+    {
+    case QEvent::Move:
+    case QEvent::Resize:
+    case QEvent::Show:
+    case QEvent::Hide:
+        updateBlurRegion();
+        break;
+    default:
+        break;
+    }
+    return QWidget::eventFilter(_watched, _event);
+}
+
+void MainWindow::updateBlurRegion()
+{
+    QRegion region;
+    for (QWidget* panel : { static_cast<QWidget*>(controlPanel_), static_cast<QWidget*>(messagePanel_), static_cast<QWidget*>(warningPanel_) })
+    {
+        if (panel->isVisibleTo(this))
+            region += QRect(contentWidget_->mapFrom(this, panel->mapTo(this, QPoint())), panel->size());
+    }
+    effect_->setRegion(region);
 }
 
 void MainWindow::showMessage(const QString& _text)
@@ -27,8 +27,10 @@ public:
 
 protected:
     void resizeEvent(QResizeEvent* _event) Q_DECL_OVERRIDE;
+    bool eventFilter(QObject* _watched, QEvent* _event) Q_DECL_OVERRIDE;
 
 private:
+    void updateBlurRegion();
     void showMessage(const QString& _text);
     void showWarning(const QString& _text);
 